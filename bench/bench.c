@@ -0,0 +1,181 @@
+/*
+  In-process benchmarks: drives wish.c's parser and path lookup
+  directly and prints one row per case with the min, median and p99
+  time of its repetitions. The format matches bench/run-bench.sh so
+  the two can be concatenated and diffed between releases.
+
+  gcc -O2 -o bench bench/bench.c && ./bench [-n] [parse|lookup]
+*/
+#define main wishMain
+#include "../wish.c"
+#undef main
+
+#define MAX_REPS 2000
+
+int compareDoubles(const void *a, const void *b) {
+  double x = *(double *)a, y = *(double *)b;
+  return x < y ? -1 : x > y;
+}
+
+double nowUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void printHeader() {
+  printf("%-10s %-22s %6s %12s %12s %12s\n", "scenario", "case", "reps",
+    "min_usec", "median_usec", "p99_usec");
+}
+
+void report(char *scenario, char *name, double *samples, int reps) {
+  qsort(samples, reps, sizeof(*samples), compareDoubles);
+  int p99 = (reps * 99 + 99) / 100 - 1;
+  printf("%-10s %-22s %6d %12.2f %12.2f %12.2f\n", scenario, name, reps,
+    samples[0], samples[reps / 2], samples[p99]);
+}
+
+// Keep repeating until there are enough samples or enough time spent
+int repsFor(double usecPerRep) {
+  int reps = 500000 / (usecPerRep > 1 ? usecPerRep : 1);
+  return reps < 5 ? 5 : reps > MAX_REPS ? MAX_REPS : reps;
+}
+
+/*
+  A line of about size bytes made of four-word commands joined by sep:
+  ' ' gives one long command, '|' a pipeline and '&' parallel groups
+*/
+char *makeLine(size_t size, char sep) {
+  char *line = malloc(size + 64);
+  size_t len = 0;
+  for (int word = 0; len + 32 < size; word++) {
+    if (word % 16 == 15 && sep == '&') {
+      len += sprintf(line + len, "cmd%d > out%d & ", word, word);
+    }
+    else if (word % 4 == 3 && sep != ' ') {
+      len += sprintf(line + len, "cmd%d %c ", word, sep);
+    }
+    else {
+      len += sprintf(line + len, "arg%d ", word);
+    }
+  }
+  len += sprintf(line + len, "last");
+  return line;
+}
+
+void benchParse() {
+  size_t sizes[] = {64, 1 << 10, 64 << 10, 1 << 20};
+  char seps[] = {' ', '|', '&'};
+  char *shapes[] = {"args", "pipes", "groups"};
+  double *samples = malloc(sizeof(double) * MAX_REPS);
+  Arena arena = {0};
+
+  for (int s = 0; s < 3; s++) {
+    for (int i = 0; i < 4; i++) {
+      char *line = makeLine(sizes[i], seps[s]);
+      size_t len = strlen(line);
+      int reps = repsFor(len / 200.0);
+      for (int r = 0; r < reps; r++) {
+        ProcessGroup *pgs;
+        double start = nowUsec();
+        if (parseLine(&arena, &pgs, line, len) < 0) {
+          fprintf(stderr, "parse failed for %s/%zu\n", shapes[s], sizes[i]);
+          exit(1);
+        }
+        samples[r] = nowUsec() - start;
+        arenaReset(&arena);
+      }
+
+      char name[64];
+      snprintf(name, sizeof(name), "%s/%zuB", shapes[s], sizes[i]);
+      report("parse", name, samples, reps);
+      free(line);
+    }
+  }
+  free(samples);
+}
+
+/*
+  findOnPath() against search paths of 1 to 256 directories, with the
+  command only in the last one. Cold lookups start from an empty hash
+  table; warm ones are hash hits.
+*/
+void benchLookup() {
+  char root[] = "/tmp/wbXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    perror("mkdtemp");
+    exit(1);
+  }
+
+  int counts[] = {1, 16, 64, 256};
+  double *samples = malloc(sizeof(double) * MAX_REPS);
+  char dir[MAX_PATH];
+  char fullPath[MAX_PATH];
+  for (int i = 0; i < 256; i++) {
+    snprintf(dir, sizeof(dir), "%s/%d", root, i);
+    mkdir(dir, 0755);
+  }
+
+  for (int c = 0; c < 4; c++) {
+    int n = counts[c];
+    SEARCH_PATH[0] = '\0';
+    for (int i = 0; i < n; i++) {
+      snprintf(dir, sizeof(dir), ";%s/%d", root, i);
+      strcat(SEARCH_PATH, dir);
+    }
+    snprintf(fullPath, sizeof(fullPath), "%s/%d/tool", root, n - 1);
+    close(open(fullPath, O_CREAT | O_WRONLY, 0755));
+
+    char name[64];
+    for (int warm = 0; warm < 2; warm++) {
+      // Tearing down the inotify watches between cold runs is slow, so
+      // take fewer of them
+      int reps = warm ? repsFor(1) : 50;
+      for (int r = 0; r < reps; r++) {
+        if (!warm) {
+          flushCommandHash();
+        }
+        double start = nowUsec();
+        if (findOnPath(fullPath, "tool") != 0) {
+          fprintf(stderr, "lookup failed with %d dirs\n", n);
+          exit(1);
+        }
+        samples[r] = nowUsec() - start;
+      }
+      snprintf(name, sizeof(name), "%s/%ddirs", warm ? "warm" : "cold", n);
+      report("lookup", name, samples, reps);
+    }
+  }
+
+  flushCommandHash();
+  for (int i = 0; i < 256; i++) {
+    snprintf(fullPath, sizeof(fullPath), "%s/%d/tool", root, i);
+    unlink(fullPath);
+    snprintf(dir, sizeof(dir), "%s/%d", root, i);
+    rmdir(dir);
+  }
+  rmdir(root);
+  free(samples);
+}
+
+int main(int argc, char **argv) {
+  // Keep the generated lines out of the history store
+  HISTORY.limit = 0;
+
+  // -n leaves out the header when appending to another report
+  int arg = 1;
+  if (arg < argc && strcmp(argv[arg], "-n") == 0) {
+    arg++;
+  }
+  else {
+    printHeader();
+  }
+  char *only = arg < argc ? argv[arg] : NULL;
+  if (only == NULL || strcmp(only, "parse") == 0) {
+    benchParse();
+  }
+  if (only == NULL || strcmp(only, "lookup") == 0) {
+    benchLookup();
+  }
+  return 0;
+}
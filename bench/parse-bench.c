@@ -0,0 +1,74 @@
+/*
+  Parser throughput sweep: times parseLine() on generated lines from
+  1 KB to 64 MB and prints ns/byte for each size. Linear parsing shows
+  up as a flat ns/byte column.
+
+  gcc -O2 -o parse-bench bench/parse-bench.c && ./parse-bench [maxMB]
+*/
+#define main wishMain
+#include "../wish.c"
+#undef main
+
+#include <time.h>
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A mix of arguments, pipes, redirections and parallel groups
+char *makeLine(size_t size) {
+  char *line = malloc(size + 1);
+  size_t len = 0;
+  int word = 0;
+  while (len + 32 < size) {
+    if (word % 1024 == 1023) {
+      len += sprintf(line + len, "cmd%d > out%d & ", word, word);
+    }
+    else if (word % 64 == 63) {
+      len += sprintf(line + len, "cmd%d | ", word);
+    }
+    else {
+      len += sprintf(line + len, "arg%d ", word);
+    }
+    word++;
+  }
+  len += sprintf(line + len, "last");
+  memset(line + len, ' ', size - len);
+  line[size] = '\0';
+  return line;
+}
+
+int main(int argc, char **argv) {
+  size_t maxSize = (argc > 1 ? atol(argv[1]) : 64) << 20;
+  Arena arena = {0};
+
+  // Keep the generated lines out of the history store
+  HISTORY.limit = 0;
+
+  printf("%12s %8s %12s %10s %10s\n", "bytes", "reps", "min_usec", "ns/byte", "MB/s");
+  for (size_t size = 1024; size <= maxSize; size *= 2) {
+    char *line = makeLine(size);
+    double best = 1e30;
+    double total = 0;
+    int reps = 0;
+    while (reps < 3 || (total < 0.5 && reps < 1000)) {
+      ProcessGroup *pgs;
+      double start = now();
+      if (parseLine(&arena, &pgs, line, size) < 0) {
+        fprintf(stderr, "parse failed at %zu bytes\n", size);
+        return 1;
+      }
+      double elapsed = now() - start;
+      arenaReset(&arena);
+      best = elapsed < best ? elapsed : best;
+      total += elapsed;
+      reps++;
+    }
+    printf("%12zu %8d %12.1f %10.2f %10.1f\n", size, reps, best * 1e6,
+      best * 1e9 / size, size / best / 1e6);
+    free(line);
+  }
+  return 0;
+}
@@ -0,0 +1,74 @@
+/*
+  Reaping benchmark: one line of N '&'-separated sleeps of mixed
+  duration. Reap latency for a child is the time from launch to being
+  reaped minus how long it slept. It is reported for the event-driven
+  reaper and for waiting on each child in launch order with a blocking
+  waitpid.
+
+  gcc -O2 -o reap-bench bench/reap-bench.c && ./reap-bench [N]
+*/
+#define main wishMain
+#include "../wish.c"
+#undef main
+
+double durations[] = {0.5, 0.01, 0.2, 0.05, 0.1};
+#define N_DURATIONS (sizeof(durations) / sizeof(*durations))
+
+double seconds(struct timespec *ts) {
+  return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+int compareDoubles(const void *a, const void *b) {
+  double x = *(double *)a, y = *(double *)b;
+  return x < y ? -1 : x > y;
+}
+
+void report(char *name, ProcessGroup *pgs, int npgs, double wall) {
+  double *lat = malloc(sizeof(*lat) * npgs);
+  for (int i = 0; i < npgs; i++) {
+    Process *p = &pgs[i].processes[0];
+    lat[i] = seconds(&p->ended) - seconds(&p->started) - durations[i % N_DURATIONS];
+  }
+  qsort(lat, npgs, sizeof(*lat), compareDoubles);
+  printf("%-8s %10.1f %12.2f %12.2f %12.2f\n", name, wall * 1e3,
+    lat[npgs / 2] * 1e3, lat[npgs * 99 / 100] * 1e3, lat[npgs - 1] * 1e3);
+  free(lat);
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 1000;
+  char *line = malloc(n * 16);
+  size_t len = 0;
+  for (int i = 0; i < n; i++) {
+    len += sprintf(line + len, "%ssleep %g", i ? " & " : "", durations[i % N_DURATIONS]);
+  }
+  HISTORY.limit = 0;
+
+  printf("%-8s %10s %12s %12s %12s\n", "reaper", "wall_ms", "median_ms", "p99_ms", "max_ms");
+  for (int mode = 0; mode < 2; mode++) {
+    Arena arena = {0};
+    ProcessGroup *pgs;
+    int npgs = parseLine(&arena, &pgs, line, len);
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    launchLine(npgs, pgs);
+    if (mode == 0) {
+      waitGroups(npgs, pgs);
+    }
+    else {
+      for (int i = 0; i < npgs; i++) {
+        Process *p = &pgs[i].processes[0];
+        wait4(p->pid, &p->status, 0, &p->rusage);
+        clock_gettime(CLOCK_MONOTONIC, &p->ended);
+      }
+      // Forget the children the event reaper never saw exit
+      memset(CHILDREN, 0, sizeof(*CHILDREN) * CHILDREN_SIZE);
+      N_CHILDREN = CHILDREN_USED = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    report(mode == 0 ? "event" : "inorder", pgs, npgs, seconds(&end) - seconds(&start));
+  }
+  return 0;
+}
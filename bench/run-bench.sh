@@ -0,0 +1,255 @@
+#! /bin/bash
+#
+# Benchmark suite. Runs the in-process parser and path lookup benchmarks
+# from bench/bench.c, then times the built wish binary on fixed batch
+# scripts. Every row gives the min, median and p99 over its repetitions
+# in microseconds, so two runs can be diffed directly.
+#
+#   spawn    one line per command: usec per 'true' (1e6 / median = cmds/sec)
+#   pipe     N-stage cat pipelines moving BENCH_BYTES: usec per run
+#   fanout   one line of N '&' groups of 'true': usec per run
+#   text     'cat FILE | TOOL' over BENCH_BYTES of text, with TOOL the
+#            wc/head/tail/grep -F builtin or the same tool on the path
+#   history  usec for the first !?text? search over BENCH_HISTORY
+#            entries, which builds the index, then usec per search after
+#   memo     'sort FILE > OUT' over BENCH_BYTES/16 of text: usec per run,
+#            plain and replayed by 'memo' from a warm cache
+#   dag      a script of BENCH_CMDS/10 independent 'cksum FILE > OUT_i'
+#            lines: usec per run, plain and with wish -j <cpus>
+#   deadline the spawn script again: usec per 'true', plain and with
+#            every line timed by --line-deadline
+#   server   usec per small job, cold './wish job' vs 'wish --client'
+#            against a warm 'wish --server' (1e6 / median = jobs/sec)
+#   syscalls system calls the shell itself makes per stage, all of them
+#            and those on fds (open/close/dup/pipe/fcntl), counted under
+#            ptrace by bench/syscount.c; these are exact, not timings
+#
+# usage: bench/run-bench.sh [-q]     (-q: smaller sizes for a quick check)
+#
+# Environment: BENCH_REPS (default 10), BENCH_BYTES (default 1 GB),
+# BENCH_CMDS (default 5000), BENCH_JOBS (default 500),
+# BENCH_HISTORY (default 1000000).
+
+REPS=${BENCH_REPS:-10}
+BYTES=${BENCH_BYTES:-$((1 << 30))}
+CMDS=${BENCH_CMDS:-5000}
+JOBS=${BENCH_JOBS:-500}
+HISTORY=${BENCH_HISTORY:-1000000}
+FANOUT="1 16 256 4096"
+STAGES="1 2 4 8"
+if [[ $1 == -q ]]; then
+  REPS=${BENCH_REPS:-3}
+  BYTES=${BENCH_BYTES:-$((64 << 20))}
+  CMDS=${BENCH_CMDS:-500}
+  JOBS=${BENCH_JOBS:-50}
+  HISTORY=${BENCH_HISTORY:-100000}
+  FANOUT="1 16 256"
+fi
+
+DIR=$(mktemp -d)
+trap 'kill $SERVER 2> /dev/null; rm -rf $DIR' EXIT
+
+cd "$(dirname "$0")/.." || exit 1
+gcc -O2 -o $DIR/wish wish.c || exit 1
+gcc -O2 -o $DIR/bench bench/bench.c || exit 1
+gcc -O2 -o $DIR/syscount bench/syscount.c || exit 1
+
+# Same percentile rule as bench.c: sort, then take index ceil(n*0.99)-1
+summarize() {
+  local scenario=$1 name=$2
+  shift 2
+  local sorted=($(printf "%s\n" "$@" | sort -n))
+  local n=${#sorted[@]}
+  local p99=$(( (n * 99 + 99) / 100 - 1 ))
+  printf "%-10s %-22s %6d %12.2f %12.2f %12.2f\n" $scenario $name $n \
+    ${sorted[0]} ${sorted[$((n / 2))]} ${sorted[$p99]}
+}
+
+# Run wish on a batch file and print the elapsed usec, divided by $2
+timeRun() {
+  local start end
+  start=$(date +%s%N)
+  $DIR/wish $1 > /dev/null
+  end=$(date +%s%N)
+  awk -v ns=$((end - start)) -v n=${2:-1} 'BEGIN { printf "%.2f\n", ns / 1000 / n }'
+}
+
+$DIR/bench
+
+# Commands per second: a batch script of nothing but 'true'
+echo "path /bin /usr/bin" > $DIR/spawn.txt
+for ((i = 0; i < CMDS; i++)); do echo true; done >> $DIR/spawn.txt
+samples=()
+for ((r = 0; r < REPS; r++)); do
+  samples+=($(timeRun $DIR/spawn.txt $CMDS))
+done
+summarize spawn true/${CMDS}cmds "${samples[@]}"
+
+# cat pipelines; the data is random so nothing compresses or dedups
+head -c $BYTES /dev/urandom > $DIR/data
+for n in $STAGES; do
+  line="cat $DIR/data"
+  for ((i = 1; i < n; i++)); do line="$line | cat"; done
+  echo "$line > /dev/null" > $DIR/pipe.txt
+  samples=()
+  for ((r = 0; r < REPS; r++)); do
+    samples+=($(timeRun $DIR/pipe.txt))
+  done
+  summarize pipe ${n}stages/$((BYTES >> 20))MB "${samples[@]}"
+done
+rm -f $DIR/data
+
+# Text builtins against the external tools, which are reached through
+# links with other names so the builtins don't pick them up
+mkdir $DIR/ext
+for tool in wc head tail grep; do
+  ln -s "$(command -v $tool)" $DIR/ext/ext$tool
+done
+head -c $((BYTES / 4 * 3)) /dev/urandom | base64 > $DIR/text
+for tool in "wc -l" "head -n 10" "tail -n 10" "grep -F wish" "grep -Fc wish"; do
+  for kind in builtin external; do
+    cmd=$tool
+    [[ $kind == external ]] && cmd=ext$tool
+    # Not /dev/null: GNU grep stops at the first match when it sees that
+    printf "path %s\ncat %s | %s > %s\n" $DIR/ext $DIR/text "$cmd" $DIR/out > $DIR/text.txt
+    samples=()
+    for ((r = 0; r < REPS; r++)); do
+      samples+=($(timeRun $DIR/text.txt))
+    done
+    summarize text "${tool// /}/$kind" "${samples[@]}"
+  done
+done
+rm -f $DIR/text $DIR/out
+
+# '&' fan-out, with enough slots that every group starts at once
+for n in $FANOUT; do
+  line="true"
+  for ((i = 1; i < n; i++)); do line="$line & true"; done
+  printf "path /bin /usr/bin\njobs-max %d\n%s\n" $n "$line" > $DIR/fanout.txt
+  samples=()
+  for ((r = 0; r < REPS; r++)); do
+    samples+=($(timeRun $DIR/fanout.txt))
+  done
+  summarize fanout ${n}groups "${samples[@]}"
+done
+
+# History search: entries that run a builtin on nothing when recalled,
+# each with a word of its own to look for
+seq $HISTORY | awk '{ printf "grep -F key%dx /dev/null\n", $1 }' > $DIR/history
+echo '!?key1x?' > $DIR/first.txt
+cp $DIR/first.txt $DIR/search.txt
+awk -v n=$HISTORY 'BEGIN { srand(1); for (i = 0; i < 1000; i++) printf "!?key%dx?\n", int(rand() * n) + 1 }' \
+  >> $DIR/search.txt
+first=()
+search=()
+for ((r = 0; r < REPS; r++)); do
+  cp $DIR/history $DIR/histfile
+  first+=($(WISH_HISTFILE=$DIR/histfile WISH_HISTSIZE=$HISTORY timeRun $DIR/first.txt))
+  cp $DIR/history $DIR/histfile
+  all=$(WISH_HISTFILE=$DIR/histfile WISH_HISTSIZE=$HISTORY timeRun $DIR/search.txt)
+  search+=($(awk -v all=$all -v first=${first[-1]} 'BEGIN { printf "%.2f\n", (all - first) / 1000 }'))
+done
+summarize history first/$((HISTORY / 1000))k "${first[@]}"
+summarize history search/$((HISTORY / 1000))k "${search[@]}"
+rm -f $DIR/history $DIR/histfile
+
+# A deterministic command run again, against replaying its output
+head -c $((BYTES / 64 * 3)) /dev/urandom | base64 > $DIR/text
+mkdir $DIR/memo
+for kind in plain memo; do
+  prefix=
+  [[ $kind == memo ]] && prefix="memo "
+  printf "path /bin /usr/bin\n%ssort %s > %s\n" "$prefix" $DIR/text $DIR/out > $DIR/memo.txt
+  WISH_MEMO_DIR=$DIR/memo $DIR/wish $DIR/memo.txt
+  samples=()
+  for ((r = 0; r < REPS; r++)); do
+    samples+=($(WISH_MEMO_DIR=$DIR/memo timeRun $DIR/memo.txt))
+  done
+  summarize memo sort/$kind "${samples[@]}"
+done
+rm -rf $DIR/text $DIR/out $DIR/memo
+
+# Independent lines of a generation script, one after another and
+# spread over every CPU by the dependency scheduler
+head -c $((BYTES / 64)) /dev/urandom > $DIR/data
+mkdir $DIR/dag
+echo "path /bin /usr/bin" > $DIR/dag.txt
+for ((i = 0; i < CMDS / 10; i++)); do
+  echo "cksum $DIR/data > $DIR/dag/out$i"
+done >> $DIR/dag.txt
+for kind in plain parallel; do
+  samples=()
+  for ((r = 0; r < REPS; r++)); do
+    start=$(date +%s%N)
+    if [[ $kind == plain ]]; then
+      $DIR/wish $DIR/dag.txt
+    else
+      $DIR/wish -j $(nproc) $DIR/dag.txt
+    fi
+    end=$(date +%s%N)
+    samples+=($(( (end - start) / 1000 )))
+  done
+  summarize dag $((CMDS / 10))lines/$kind "${samples[@]}"
+done
+rm -rf $DIR/data $DIR/dag
+
+# What a deadline costs a line that finishes well within it: its own
+# process group and two timerfd updates
+for kind in plain timed; do
+  options=
+  [[ $kind == timed ]] && options="--line-deadline 1m"
+  samples=()
+  for ((r = 0; r < REPS; r++)); do
+    start=$(date +%s%N)
+    $DIR/wish $options $DIR/spawn.txt > /dev/null
+    end=$(date +%s%N)
+    samples+=($(awk -v ns=$((end - start)) -v n=$CMDS 'BEGIN { printf "%.2f\n", ns / 1000 / n }'))
+  done
+  summarize deadline true/$kind "${samples[@]}"
+done
+
+# Jobs per second: the same small script run by a fresh wish each time
+# and by sessions of a server that already has the path and hash warm
+printf "path /bin /usr/bin\nls / > /dev/null\n" > $DIR/job.txt
+printf "path /bin /usr/bin\nhash ls\n" > $DIR/init.txt
+$DIR/wish --server $DIR/sock $DIR/init.txt &
+SERVER=$!
+while ! [[ -S $DIR/sock ]]; do sleep 0.01; done
+
+jobsRun() {
+  local start end
+  start=$(date +%s%N)
+  for ((j = 0; j < JOBS; j++)); do
+    "$@" $DIR/job.txt
+  done
+  end=$(date +%s%N)
+  awk -v ns=$((end - start)) -v n=$JOBS 'BEGIN { printf "%.2f\n", ns / 1000 / n }'
+}
+
+for mode in cold warm; do
+  samples=()
+  for ((r = 0; r < REPS; r++)); do
+    if [[ $mode == cold ]]; then
+      samples+=($(jobsRun $DIR/wish))
+    else
+      samples+=($(jobsRun $DIR/wish --client $DIR/sock))
+    fi
+  done
+  summarize server $mode/job "${samples[@]}"
+done
+
+# Per-stage syscalls: plain commands, pipelines, and redirected builtins
+# and commands, each repeated so the startup cost washes out
+printf "%-10s %-22s %6s %12s %12s\n" scenario case stages total/stage fd/stage
+syscalls() {
+  local name=$1 stages=$2 line=$3
+  echo "path /bin /usr/bin" > $DIR/sys.txt
+  for ((i = 0; i < CMDS; i++)); do echo "$line"; done >> $DIR/sys.txt
+  set -- $($DIR/syscount $((CMDS * stages)) $DIR/wish $DIR/sys.txt)
+  printf "%-10s %-22s %6d %12.2f %12.2f\n" syscalls $name $stages $3 $4
+}
+syscalls true 1 "true"
+syscalls redirect 1 "true > /dev/null"
+syscalls pipe 4 "true | true | true | true"
+syscalls builtin 1 "showpath > /dev/null"
+syscalls builtin-pipe 2 "showpath | true"
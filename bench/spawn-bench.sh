@@ -0,0 +1,36 @@
+#! /bin/bash
+#
+# Compare the spawn rate of the posix_spawn launcher against plain fork.
+# Builds wish both ways and runs a batch file of N external commands.
+#
+# usage: bench/spawn-bench.sh [N]
+
+N=${1:-5000}
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+cd "$(dirname "$0")/.." || exit 1
+gcc -O2 -o $DIR/wish-spawn wish.c -DUSE_SPAWN=true || exit 1
+gcc -O2 -o $DIR/wish-fork wish.c -DUSE_SPAWN=false || exit 1
+
+for i in $(seq $N); do echo "true"; done > $DIR/single.txt
+for i in $(seq $N); do echo "true | true | true | true"; done > $DIR/pipeline.txt
+
+run() {
+  local start end
+  start=$(date +%s%N)
+  $1 $2 > /dev/null
+  end=$(date +%s%N)
+  echo $(( (end - start) / 1000 ))
+}
+
+printf "%-10s %-10s %12s %12s\n" launcher workload usec spawns/sec
+for launcher in spawn fork; do
+  for workload in single pipeline; do
+    usec=$(run $DIR/wish-$launcher $DIR/$workload.txt)
+    spawns=$N
+    [[ $workload == pipeline ]] && spawns=$((N * 4))
+    printf "%-10s %-10s %12d %12d\n" $launcher $workload $usec \
+      $(( spawns * 1000000 / (usec > 0 ? usec : 1) ))
+  done
+done
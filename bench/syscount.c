@@ -0,0 +1,82 @@
+/*
+  Count the system calls the shell itself makes while running a batch
+  script, and how many of them touch file descriptors. The shell is run
+  under ptrace without following its children, so only its own calls
+  are counted; dividing by the number of stages in the script gives
+  the per-stage cost of setting one up.
+
+  gcc -O2 -o syscount bench/syscount.c && ./syscount STAGES ./wish script
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+bool isFdCall(long nr) {
+  switch (nr) {
+    case SYS_open:
+    case SYS_openat:
+    case SYS_close:
+    case SYS_dup:
+    case SYS_dup2:
+    case SYS_dup3:
+    case SYS_pipe:
+    case SYS_pipe2:
+    case SYS_fcntl:
+      return true;
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s STAGES command...\n", argv[0]);
+    return 1;
+  }
+  long stages = atol(argv[1]);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
+    execvp(argv[2], argv + 2);
+    perror(argv[2]);
+    _exit(127);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+
+  // Stops alternate between syscall entry and exit
+  long total = 0, fd = 0;
+  bool entry = true;
+  int sig = 0;
+  while (ptrace(PTRACE_SYSCALL, pid, NULL, sig) == 0 && waitpid(pid, &status, 0) == pid) {
+    sig = 0;
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      break;
+    }
+    if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+      // Pass real signals (SIGCHLD and so on) through
+      sig = WSTOPSIG(status) == SIGTRAP ? 0 : WSTOPSIG(status);
+      continue;
+    }
+    if (entry) {
+      struct user_regs_struct regs;
+      ptrace(PTRACE_GETREGS, pid, NULL, &regs);
+      total++;
+      fd += isFdCall(regs.orig_rax);
+    }
+    entry = !entry;
+  }
+
+  printf("%ld %ld %.2f %.2f\n", total, fd,
+    stages > 0 ? (double)total / stages : 0.0, stages > 0 ? (double)fd / stages : 0.0);
+  return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,987 +8,6950 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <spawn.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/timerfd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define MAX_PATH (5096)
 #define ERROR_MSG "An error has occurred\n"
-#define LOG false
+#define CAT_CHUNK_SIZE (1 << 30)
+#define CAT_BUFFER_SIZE (1 << 20)
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN (16)
+#define HISTORY_DEFAULT_SIZE (10000)
+#define HISTORY_WRITE_SIZE (64 * 1024)
+#define JOBS_MAX_FLOOR 8
+#define INPUT_CHUNK_SIZE (1 << 20)
+#define TRACE_EVENTS (1 << 16)
+// How long a timed-out line gets between SIGTERM and SIGKILL
+#define TIMEOUT_GRACE_NS (2000000000ULL)
+// Launch external commands with posix_spawn (vfork-style) instead of fork
+#ifndef USE_SPAWN
+#define USE_SPAWN true
+#endif
+// Diagnostics, switched on at runtime with WISH_LOG=1
+bool LOG = false;
 #define logPrint(...) if (LOG) {fprintf(stderr, "[%*.*s]\t", 12, 12, __func__); fprintf(stderr, __VA_ARGS__);}
 
+extern char **environ;
+
 char SEARCH_PATH[MAX_PATH] = "/bin";
-char HISTORY[100][5096];
-int N_HISTORY_ENTRIES = 0;
+/*
+  History entries are packed back to back (NUL-terminated) in one
+  growable buffer, with an offset per entry for O(1) lookup by event
+  number. Event numbers keep counting up as old entries are dropped.
+*/
+typedef struct {
+  char *buf;
+  size_t used;
+  size_t cap;
+  size_t *offsets;
+  int count;
+  int maxEntries;
+  int base;
+  int limit;
+  int fd;
+} History;
+
+History HISTORY;
+
+/*
+  Trigram index over the history for reverse search. Each trigram maps
+  to the events containing it, oldest first, stored as varint deltas so
+  a list costs about a byte per entry; the last event is kept alongside
+  so a list can be walked newest first. Every entry is indexed as if it
+  started with two newlines, which no entry contains, so prefixes can
+  be looked up too. Entries are indexed lazily on the first search after
+  they were added.
+*/
+typedef struct {
+  uint32_t key;
+  int count;
+  int last;
+  unsigned char *deltas;
+  size_t len;
+  size_t cap;
+} Posting;
+
+typedef struct {
+  Posting *table;
+  size_t size;
+  size_t used;
+  int indexed;
+  unsigned long searches;
+  unsigned long long candidates;
+} HistoryIndex;
+
+HistoryIndex HISTORY_INDEX;
+
+/*
+  Command hash table: maps a command name to the path it resolved to
+  on SEARCH_PATH (or NULL if it was not found). Each entry remembers
+  the epoch it was resolved in and which directory it was found in, so
+  a change to a directory only invalidates the entries that depended
+  on it.
+*/
+typedef struct {
+  char *name;
+  char *path;
+  int dir;
+  int hits;
+  unsigned long epoch;
+} HashEntry;
+
+typedef struct {
+  char *dir;
+  int wd;
+  struct timespec mtime;
+  unsigned long changed;
+} PathDir;
+
+// Counters reported by the stats builtin. The cat and text ones are
+// bumped from builtin threads, so only ever atomically.
+typedef struct {
+  unsigned long long catBytes;
+  unsigned long catCopyFileRange;
+  unsigned long catSendfile;
+  unsigned long catSplice;
+  unsigned long catReadWrite;
+  unsigned long long textBytes;
+  unsigned long globWords;
+  unsigned long long globPaths;
+  unsigned long dagLines;
+  unsigned long dagBarriers;
+  int dagPeak;
+  unsigned long memoHits;
+  unsigned long memoMisses;
+  unsigned long memoStored;
+  unsigned long memoEvicted;
+  unsigned long long memoReplayedBytes;
+  unsigned long timeoutLines;
+  unsigned long timeoutSignals;
+  unsigned long arenaChunks;
+  unsigned long arenaResets;
+  size_t arenaPeakBytes;
+  unsigned long reapWakeups;
+  unsigned long reaped;
+  unsigned long schedGroups;
+  unsigned long schedQueued;
+  unsigned long long schedWaitNs;
+  unsigned long long schedBusyNs;
+  unsigned long long schedSlotNs;
+  unsigned long long lastWaitNs;
+  double lastUtilisation;
+} Stats;
+
+Stats STATS;
+
+/*
+  Tracing: events go into a fixed ring buffer of binary records with a
+  monotonic timestamp, so recording one costs a clock read and a few
+  stores. Nothing is formatted until the buffer is dumped as Chrome
+  trace_event JSON (load it in chrome://tracing or Perfetto).
+*/
+typedef enum {
+  TRACE_PARSE,
+  TRACE_LOOKUP,
+  TRACE_PIPE,
+  TRACE_REDIRECT,
+  TRACE_SPAWN,
+  TRACE_FORK,
+  TRACE_BUILTIN,
+  TRACE_WAIT,
+  TRACE_REAP,
+  TRACE_CHILD,
+  TRACE_PLACE,
+  TRACE_GLOB,
+} TraceKind;
+
+char *TRACE_NAMES[] = {"parse", "lookup", "pipe", "redirect", "spawn", "fork",
+  "builtin", "wait", "reap", "child", "place", "glob"};
+
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+  long arg;
+  pid_t tid;
+  int kind;
+} TraceEvent;
+
+bool TRACING = false;
+TraceEvent *TRACE_RING = NULL;
+unsigned long TRACE_NEXT = 0;
+char *TRACE_FILE = NULL;
+__thread pid_t TRACE_TID = 0;
+
+uint64_t timespecNs(struct timespec *ts) {
+  return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return timespecNs(&ts);
+}
+
+void recordTrace(TraceKind kind, uint64_t start, uint64_t end, pid_t tid, long arg) {
+  unsigned long i = __atomic_fetch_add(&TRACE_NEXT, 1, __ATOMIC_RELAXED);
+  TraceEvent *e = &TRACE_RING[i & (TRACE_EVENTS - 1)];
+  e->start = start;
+  e->end = end;
+  e->arg = arg;
+  e->tid = tid;
+  e->kind = kind;
+}
+
+// Start and finish a span on the calling thread
+static inline uint64_t traceStart() {
+  return TRACING ? nowNs() : 0;
+}
+
+static inline void traceEnd(TraceKind kind, uint64_t start, long arg) {
+  if (TRACING && start != 0) {
+    if (TRACE_TID == 0) {
+      TRACE_TID = gettid();
+    }
+    recordTrace(kind, start, nowNs(), TRACE_TID, arg);
+  }
+}
+
+void startTracing() {
+  if (TRACE_RING == NULL) {
+    TRACE_RING = calloc(TRACE_EVENTS, sizeof(TraceEvent));
+  }
+  TRACING = true;
+}
+
+int dumpTrace(char *file) {
+  FILE *f = fopen(file, "we");
+  if (f == NULL) {
+    return -1;
+  }
+
+  unsigned long end = TRACE_NEXT;
+  unsigned long start = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+  pid_t shell = getpid();
+  fprintf(f, "{\"traceEvents\":[\n");
+  fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"wish\"}}",
+    shell);
+  for (unsigned long i = start; i < end && TRACE_RING != NULL; i++) {
+    TraceEvent *e = &TRACE_RING[i & (TRACE_EVENTS - 1)];
+    fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+      "\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%ld}}",
+      TRACE_NAMES[e->kind], e->start / 1e3, (e->end - e->start) / 1e3,
+      shell, e->tid, e->arg);
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f);
+}
+
+pid_t TRACE_OWNER = 0;
+
+void dumpTraceAtExit() {
+  // A forked builtin that calls exit() must not write the shell's trace
+  if (getpid() != TRACE_OWNER) {
+    return;
+  }
+  if (TRACE_FILE != NULL && dumpTrace(TRACE_FILE) != 0) {
+    perror(TRACE_FILE);
+  }
+}
+
+// WISH_TRACE=FILE traces the whole session and writes it out on exit
+void initTracing() {
+  char *log = getenv("WISH_LOG");
+  LOG = log != NULL && *log != '\0' && strcmp(log, "0") != 0;
+
+  char *file = getenv("WISH_TRACE");
+  if (file != NULL && *file != '\0') {
+    TRACE_FILE = strdup(file);
+    TRACE_OWNER = getpid();
+    startTracing();
+    atexit(dumpTraceAtExit);
+  }
+}
+
+HashEntry *CMD_HASH = NULL;
+int CMD_HASH_SIZE = 0;
+int CMD_HASH_COUNT = 0;
+PathDir *PATH_DIRS = NULL;
+int N_PATH_DIRS = 0;
+bool PATH_DIRS_LOADED = false;
+int PATH_NOTIFY_FD = -1;
+unsigned long PATH_EPOCH = 0;
 
 typedef struct {
   int nargs;
   int pid;
   bool executed;
+  bool reaped;
+  bool stopped;
+  int status;
+  struct rusage rusage;
+  struct timespec started;
+  struct timespec ended;
+  // The CPU the process is pinned to, or -1
+  int cpu;
   char *rfin;
   char *rfout;
+  // A here-document's delimiter or a here-string's word, and the
+  // sealed memfd its body ends up in
+  char *here;
+  bool hereString;
+  int hereFd;
   char **args;
 } Process;
 
 typedef struct {
-  int pgid;
+  int id;
+  pid_t pgid;
   bool background;
+  bool foreground;
   int nprocesses;
+  int running;
+  int stopped;
+  int threads;
   bool run;
+  // A timed group gets a process group of its own even without job
+  // control, so a deadline can signal everything it started. Not on
+  // a terminal, where it would be cut off from ^C and the tty.
+  bool isolated;
+  bool expired;
+  struct timespec launched;
   Process *processes;
 } ProcessGroup;
 
+// A running child, so the reaper can find its Process by pid
+typedef struct {
+  pid_t pid;
+  Process *p;
+  ProcessGroup *pg;
+} Child;
+
+Child *CHILDREN = NULL;
+int CHILDREN_SIZE = 0;
+int CHILDREN_USED = 0;
+int N_CHILDREN = 0;
+int EVENT_FD = -1;
+int SIGNAL_FD = -1;
+int TIMER_FD = -1;
+
+// A builtin running on a thread as one stage of a pipeline
+typedef struct BuiltInThread {
+  pthread_t thread;
+  Process *p;
+  ProcessGroup *pg;
+  int in;
+  int out;
+  int rc;
+  struct rusage rusage;
+  bool done;
+  struct BuiltInThread *next;
+} BuiltInThread;
+
+BuiltInThread *THREADS = NULL;
+int N_THREADS = 0;
+// Set while wish -j starts a line next to others, or while a timed line
+// starts: builtins that would run on a thread get a process of their
+// own instead, since the shell's stdout is only theirs for now and a
+// thread can't be killed
+bool DETACHED_LAUNCH = false;
+int THREAD_EVENT_FD = -1;
+
+typedef enum {
+  JOB_RUNNING,
+  JOB_STOPPED,
+} JobState;
+
+typedef struct Job {
+  int id;
+  JobState state;
+  char *command;
+  ProcessGroup group;
+  struct termios tmodes;
+  bool hasTmodes;
+  struct Job *next;
+} Job;
+
+Job *JOBS = NULL;
+bool INTERACTIVE = false;
+bool JOB_CONTROL = false;
+pid_t SHELL_PGID = 0;
+struct termios SHELL_TMODES;
+
+// At most JOBS_MAX groups of a line run at once; 0 disables LOAD_MAX
+int JOBS_MAX = 0;
+double LOAD_MAX = 0;
+struct timespec LINE_LAUNCHED;
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t size;
+  size_t used;
+  char data[] __attribute__((aligned(ARENA_ALIGN)));
+} ArenaChunk;
+
+typedef struct {
+  ArenaChunk *head;
+  ArenaChunk *current;
+  void *last;
+  size_t used;
+} Arena;
+
+typedef enum {
+  TIME_OFF,
+  TIME_TEXT,
+  TIME_JSON,
+} TimeMode;
+
+// A memo line's cache key, and where its output goes once it has run
+typedef struct {
+  bool on;
+  bool hit;
+  char key[33];
+  char *dest;
+  char temp[MAX_PATH];
+} Memo;
+
+// A parsed line along with the arena its parse tree lives in
+typedef struct Line {
+  Arena arena;
+  ProcessGroup *pgs;
+  int npgs;
+  char *echo;
+  int errors;
+  bool async;
+  TimeMode timed;
+  Memo memo;
+  // Where the line starts in its script, how long it may run for, and
+  // the next time it gets a signal if it is still running then
+  long number;
+  uint64_t timeoutNs;
+  uint64_t graceNs;
+  uint64_t deadline;
+  int signalled;
+  struct Line *nextTimed;
+} Line;
+
+typedef struct {
+  int fd;
+  char *map;
+  size_t size;
+  size_t pos;
+  char *buf;
+  size_t cap;
+  size_t start;
+  size_t end;
+  bool eof;
+  long lines;
+} Input;
+
 typedef enum {
   PENDING_ARGUMENT,
   ARGUMENT,
   RFIN,
   RFOUT,
+  HEREDOC,
+  HERESTRING,
   END,
 } state;
 
+// changeState() delimiters for << and <<<, which are more than one char
+#define DELIM_HEREDOC 'H'
+#define DELIM_HERESTRING 'S'
+
+// Where here-document bodies are read from: the input the line came from
+Input *LINE_INPUT = NULL;
+
+// Set while parsing ahead, so output is held back until the line runs
+Line *DEFER_TO = NULL;
+
 void printError(){
+  if (DEFER_TO != NULL) {
+    DEFER_TO->errors++;
+    return;
+  }
   write(STDERR_FILENO, ERROR_MSG, strlen(ERROR_MSG));
 }
 
-void printProcess(Process *p){
+/*
+  Children are reaped from one place: SIGCHLD is blocked and delivered
+  through a signalfd that sits in an epoll set. Every running child is
+  recorded in a table keyed by pid, so each one is matched to its
+  Process as soon as it exits regardless of launch order.
+*/
+void initEvents() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
 
-  logPrint("Process %d:\n", p->pid);
-  logPrint("\tNumber of Arguments: %d\n", p->nargs);
-  logPrint("\tArguments:\n");
-  for (int i = 0; i < p->nargs; i++){
-    logPrint("\t\t%s\n", p->args[i]);
+  SIGNAL_FD = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  THREAD_EVENT_FD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  TIMER_FD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  EVENT_FD = epoll_create1(EPOLL_CLOEXEC);
+  if (SIGNAL_FD < 0 || THREAD_EVENT_FD < 0 || TIMER_FD < 0 || EVENT_FD < 0) {
+    perror("signalfd");
+    exit(1);
   }
-  logPrint("\tInput File: %s\n", p->rfin);
-  logPrint("\tOutput File: %s\n", p->rfout);
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.fd = SIGNAL_FD};
+  epoll_ctl(EVENT_FD, EPOLL_CTL_ADD, SIGNAL_FD, &ev);
+  ev.data.fd = THREAD_EVENT_FD;
+  epoll_ctl(EVENT_FD, EPOLL_CTL_ADD, THREAD_EVENT_FD, &ev);
+  ev.data.fd = TIMER_FD;
+  epoll_ctl(EVENT_FD, EPOLL_CTL_ADD, TIMER_FD, &ev);
 }
 
-void printProcessGroup(ProcessGroup *pg){
-  logPrint("Process Group %d:\n", pg->pgid);
-  logPrint("\tBackground? %s\n", pg->background ? "yes" : "no");
-  logPrint("\tNumber of Processes: %d\n", pg->nprocesses);
-  logPrint("\tProcesses:\n")
-  for (int i = 0; i < pg->nprocesses; i++) {
-    printProcess(&(pg->processes[i]));
-  }
+// Undo the shell's signal setup in a child that is about to exec
+void resetChildSignals() {
+  sigset_t empty;
+  sigemptyset(&empty);
+  sigprocmask(SIG_SETMASK, &empty, NULL);
 }
 
-void freeProcess(Process *p) {
-  if (p) {
-    free(p->rfin);
-    p->rfin = NULL;
-    free(p->rfout);
-    p->rfout = NULL;
-    for (int i = 0; i < p->nargs; i++) {
-      free(p->args[i]);
-      p->args[i] = NULL;
-    }
-    free(p->args);
-    p->args = NULL;
+Child *findChildSlot(Child *table, int size, pid_t pid) {
+  int i = (unsigned)pid & (size - 1);
+  while (table[i].pid != 0 && table[i].pid != pid) {
+    i = (i + 1) & (size - 1);
   }
+  return &table[i];
 }
 
-void freeGroup(ProcessGroup *pg) {
-  if (pg) {
-    for (int i = 0; i < pg->nprocesses; i++) {
-      freeProcess(&(pg->processes[i]));
+void growChildren() {
+  int newSize = CHILDREN_SIZE == 0 ? 64 : CHILDREN_SIZE;
+  while (N_CHILDREN * 4 >= newSize) {
+    newSize *= 2;
+  }
+  Child *newTable = calloc(newSize, sizeof(*newTable));
+  for (int i = 0; i < CHILDREN_SIZE; i++) {
+    if (CHILDREN[i].pid > 0) {
+      *findChildSlot(newTable, newSize, CHILDREN[i].pid) = CHILDREN[i];
     }
-    pg->processes = NULL;
   }
+  free(CHILDREN);
+  CHILDREN = newTable;
+  CHILDREN_SIZE = newSize;
+  CHILDREN_USED = N_CHILDREN;
 }
 
-void cleanup(ProcessGroup *pg, int n) {
-  for (int i = 0; i < n; i++) {
-    freeGroup(&pg[i]);
+void trackChild(Process *p, ProcessGroup *pg) {
+  // Tombstones count towards the load, so rebuild before it gets high
+  if ((CHILDREN_USED + 1) * 2 > CHILDREN_SIZE) {
+    growChildren();
+  }
+  Child *c = findChildSlot(CHILDREN, CHILDREN_SIZE, p->pid);
+  if (c->pid == 0) {
+    CHILDREN_USED++;
   }
-  pg = NULL;
+  c->pid = p->pid;
+  c->p = p;
+  c->pg = pg;
+  N_CHILDREN++;
+  pg->running++;
+  clock_gettime(CLOCK_MONOTONIC, &p->started);
 }
 
-bool charInString(char a, char *s){
-  char b;
-  for (int i = 0; (b = s[i]); i++) {
-    if (a == b) {
-      return true;
+void reapChildren() {
+  int status;
+  struct rusage ru;
+  pid_t pid;
+
+  int options = WNOHANG | (JOB_CONTROL ? WUNTRACED | WCONTINUED : 0);
+  STATS.reapWakeups++;
+  while ((pid = wait4(-1, &status, options, &ru)) > 0) {
+    if (CHILDREN_SIZE == 0) {
+      continue;
+    }
+    Child *c = findChildSlot(CHILDREN, CHILDREN_SIZE, pid);
+    if (c->pid != pid) {
+      logPrint("Reaped unknown child %d\n", pid);
+      continue;
     }
+
+    Process *p = c->p;
+    if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
+      bool stopped = WIFSTOPPED(status);
+      if (p->stopped != stopped) {
+        p->stopped = stopped;
+        c->pg->stopped += stopped ? 1 : -1;
+      }
+      logPrint("Process %d %s\n", pid, stopped ? "stopped" : "continued");
+      continue;
+    }
+    if (p->stopped) {
+      p->stopped = false;
+      c->pg->stopped--;
+    }
+
+    STATS.reaped++;
+    clock_gettime(CLOCK_MONOTONIC, &p->ended);
+    p->status = status;
+    p->rusage = ru;
+    p->reaped = true;
+    c->pg->running--;
+    if (TRACING) {
+      // The child's own lifetime gets a row of its own next to the shell's
+      uint64_t ended = timespecNs(&p->ended);
+      recordTrace(TRACE_CHILD, timespecNs(&p->started), ended, pid, status);
+      recordTrace(TRACE_REAP, ended, nowNs(), getpid(), pid);
+    }
+    logPrint("Reaped process %d (status %d)\n", pid, status);
+
+    // Leave a tombstone so probing for other pids still works
+    c->pid = -1;
+    c->p = NULL;
+    c->pg = NULL;
+    N_CHILDREN--;
   }
-  return false;
 }
 
-int saveCommandToHistory(char *line) {
-  logPrint("Current History (n=%d):\n", N_HISTORY_ENTRIES);
-  for (int i = 0; i < N_HISTORY_ENTRIES; i++) {
-    logPrint("[%5.i %s]\n", i+1, HISTORY[i]);
+// Builtin threads finish like children do: their stage is marked
+// reaped and the group has one fewer thing running
+void reapThreads() {
+  BuiltInThread **t = &THREADS;
+  while (*t != NULL) {
+    BuiltInThread *done = *t;
+    if (!__atomic_load_n(&done->done, __ATOMIC_ACQUIRE)) {
+      t = &done->next;
+      continue;
+    }
+    pthread_join(done->thread, NULL);
+    Process *p = done->p;
+    clock_gettime(CLOCK_MONOTONIC, &p->ended);
+    p->status = done->rc == 0 ? 0 : 1 << 8;
+    p->rusage = done->rusage;
+    p->reaped = true;
+    done->pg->running--;
+    done->pg->threads--;
+    N_THREADS--;
+    logPrint("Joined builtin thread for %s\n", p->args ? p->args[0] : "?");
+
+    *t = done->next;
+    free(done);
   }
+}
 
-  if (
-    charInString(line[0], " \t\n") ||
-    (N_HISTORY_ENTRIES > 0 && strcmp(line, HISTORY[N_HISTORY_ENTRIES-1]) == 0)
-  ) {
-    return 0;
+/*
+  Deadlines. A line run under timeout, or any line once --line-deadline
+  is given, is linked into TIMED_LINES with the time it is due, and one
+  timerfd in the epoll set is kept armed for the earliest of them. When
+  it fires, every group of an overdue line is sent SIGTERM, then
+  SIGKILL if it is still around after the grace period. Off a terminal,
+  timed groups get process groups of their own so that whatever their
+  commands started goes too; on one they have to stay in the terminal's
+  foreground group, so only the processes the shell started are sent
+  the signals.
+*/
+Line *TIMED_LINES = NULL;
+uint64_t LINE_DEADLINE = 0;
+
+void armTimer() {
+  uint64_t next = 0;
+  for (Line *l = TIMED_LINES; l != NULL; l = l->nextTimed) {
+    if (l->deadline != 0 && (next == 0 || l->deadline < next)) {
+      next = l->deadline;
+    }
   }
-  
-  int i;
-  for (i = 0; i < strlen(line); i++) {
-    if (line[i] == '\n'){
-      HISTORY[N_HISTORY_ENTRIES][i] = '\0';
-      break;
+  // An all-zero it_value disarms the timer
+  struct itimerspec when = {0};
+  when.it_value.tv_sec = next / 1000000000;
+  when.it_value.tv_nsec = next % 1000000000;
+  timerfd_settime(TIMER_FD, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+void signalLine(Line *l, int sig) {
+  for (int i = 0; i < l->npgs; i++) {
+    ProcessGroup *pg = &l->pgs[i];
+    pg->expired = true;
+    if (pg->pgid > 0 && pg->running > 0) {
+      kill(-pg->pgid, sig);
+      // A stopped group would only see SIGTERM once continued
+      if (pg->stopped > 0) {
+        kill(-pg->pgid, SIGCONT);
+      }
+      continue;
+    }
+    for (int j = 0; j < pg->nprocesses; j++) {
+      Process *p = &pg->processes[j];
+      if (p->executed && !p->reaped && p->pid > 0) {
+        kill(p->pid, sig);
+      }
     }
-    HISTORY[N_HISTORY_ENTRIES][i] = line[i];
   }
-  HISTORY[N_HISTORY_ENTRIES][i] = '\0';
+}
 
-  N_HISTORY_ENTRIES = N_HISTORY_ENTRIES + 1;
-  return 0;
+void fireDeadlines() {
+  uint64_t now = nowNs();
+  for (Line *l = TIMED_LINES; l != NULL; l = l->nextTimed) {
+    if (l->deadline == 0 || l->deadline > now) {
+      continue;
+    }
+    l->signalled = l->signalled == 0 ? SIGTERM : SIGKILL;
+    l->deadline = l->signalled == SIGTERM ? now + l->graceNs : 0;
+    logPrint("Line %ld ran out of time, sending %s\n", l->number,
+      l->signalled == SIGTERM ? "SIGTERM" : "SIGKILL");
+    signalLine(l, l->signalled);
+    STATS.timeoutSignals++;
+  }
+  armTimer();
 }
 
-char* replaceBangs(char **linePtr) {
-  char *copy = strdup(*linePtr);
-  char *newline = calloc(strlen(copy), sizeof(char) * strlen(copy));
-  logPrint("Initial length of newline: %d\n", (int) strlen(newline));
-  char *numbers = "1234567890";
-  bool replaced = false;
+// Called just before l is launched, so the clock covers all of it
+void armDeadline(Line *l) {
+  if (LINE_DEADLINE > 0 && (l->timeoutNs == 0 || LINE_DEADLINE < l->timeoutNs)) {
+    l->timeoutNs = LINE_DEADLINE;
+  }
+  if (l->timeoutNs == 0) {
+    return;
+  }
+  if (EVENT_FD < 0) {
+    initEvents();
+  }
+  bool isolate = !JOB_CONTROL && !isatty(STDIN_FILENO);
+  for (int i = 0; i < l->npgs; i++) {
+    l->pgs[i].isolated = isolate;
+  }
+  l->deadline = nowNs() + l->timeoutNs;
+  l->nextTimed = TIMED_LINES;
+  TIMED_LINES = l;
+  armTimer();
+}
 
-  /*
-    Iterate over the line until a ! followed by a number is found
-  */
-  char *numptr;
-  int startidx = 0;
-  logPrint("Length of line: %d\n", (int)strlen(copy));
-  for (int i = 0; i < strlen(*linePtr); i++) {
-    logPrint("Current i: %i, current char: '%c', length of newline: %d\n", i, copy[i], (int) strlen(newline));
-    // If char is a newline character, nullify it and end loop
-    if (copy[i] == '\n') {
-      logPrint("Nullified a \\n\n");
-      copy[i] = '\0';
+void disarmDeadline(Line *l) {
+  for (Line **t = &TIMED_LINES; *t != NULL; t = &(*t)->nextTimed) {
+    if (*t == l) {
+      *t = l->nextTimed;
+      armTimer();
       break;
     }
-    else if (copy[i] == '!'){
-      if (i == strlen(copy)-1 || !charInString(copy[i+1], numbers)) {
-        logPrint("Ignoring bang not followed by a number: %c%c\n", copy[i], copy[i+1]);
+  }
+  l->deadline = 0;
+}
+
+// Block until something happens, then reap whatever has exited
+void waitForEvents() {
+  struct epoll_event events[8];
+  uint64_t start = traceStart();
+  int n = epoll_wait(EVENT_FD, events, 8, -1);
+  traceEnd(TRACE_WAIT, start, n);
+  for (int i = 0; i < n; i++) {
+    if (events[i].data.fd == SIGNAL_FD) {
+      struct signalfd_siginfo info;
+      while (read(SIGNAL_FD, &info, sizeof(info)) > 0) {
         continue;
       }
-      /*
-        Add NULL first so strcat knows where to end
-        Realloc newline to hold itself plus new data from copy
-        cat current string onto newline
-        (startidx should be the index of the first non-numeric char
-        after the latest event replacement )
-      */
-      copy[i] = '\0';
-      int len = strlen(newline) + strlen(copy + startidx) + 1;
-      newline = realloc(newline, sizeof(char) * len);
-      newline = strcat(newline, copy + startidx);
-      /*
-        Iterate over the number following the bang and
-        copy the number to a new string
-        The first digit is 1 past the index i, since i is 
-        currently pointed at the !
-      */
-      char numstr[10];
-      numptr = copy + i + 1; // numptr = &copy[i+1]
-      int j;
-      for (j = 0; charInString(numptr[j], numbers); j++) {
-        if (j >= 9) {
-          logPrint("Event out of range: !%s... Max digits is 9\n", numstr);
-          printError();
-          return NULL;
-        }
-        numstr[j] = numptr[j];
-      }
-
-      // Lookup event in history array and cat onto newline if found
-      int event = atoi(numstr);
-      logPrint("Found event value %d\n", event);
-      if (event > 0 && event <= N_HISTORY_ENTRIES) {
-        logPrint("Found event: '%s'\n", HISTORY[event-1])
-        int len = strlen(newline) + strlen(HISTORY[event-1]) + 1;
-        newline = realloc(newline, sizeof(char) * len);
-        newline = strcat(newline, HISTORY[event - 1]);
-        logPrint("Current line: '%s'\n", newline);
+    }
+    else if (events[i].data.fd == THREAD_EVENT_FD) {
+      uint64_t count;
+      if (read(THREAD_EVENT_FD, &count, sizeof(count)) > 0) {
+        reapThreads();
       }
-      else {
-        logPrint("Event out of range: !%d [1-%d]\n", event, N_HISTORY_ENTRIES);
-        printError();
-        return NULL;
+    }
+    else if (events[i].data.fd == TIMER_FD) {
+      uint64_t count;
+      if (read(TIMER_FD, &count, sizeof(count)) > 0) {
+        fireDeadlines();
       }
-
-      replaced = true;
-      
-      // move startidx and i ahead so on next loop iter 
-      // they  will be pointing after the numbers
-      i = i + j;
-      startidx = i + 1;
-      logPrint("Next i: %d, next char: %c[%c]%c\n", i, copy[i-1], copy[i], copy[i+1]);
     }
-    logPrint("End of loop, i=%d, length = %d\n", i, (int)strlen(*linePtr));
   }
+  reapChildren();
+}
 
-  // Final copying and resizing
-  int len = strlen(newline) + strlen(copy + startidx) + 1;
-  newline = realloc(newline, sizeof(char) * len);
-  newline = strcat(newline, copy + startidx);
+/*
+  Job control. Interactive shells run a line ending in & in the
+  background: each of its groups becomes a Job that outlives the line,
+  so its Processes are copied out of the line's arena. On a terminal
+  every group also gets its own process group, and the foreground one
+  is given the terminal while the shell waits for it.
+*/
+void initJobControl() {
+  if (!isatty(STDIN_FILENO)) {
+    return;
+  }
 
-  logPrint("Length of newline: %d\n", (int) strlen(newline));
-  // free(*linePtr);
-  *linePtr = malloc(sizeof(char) * (strlen(newline) + 1));
-  *linePtr = strcpy(*linePtr, newline);
-  free(newline);
-  free(copy);
-  
-  if (replaced) {
-    printf("%s\n", *linePtr);
+  // Wait until the shell has been put in the foreground
+  while (tcgetpgrp(STDIN_FILENO) != (SHELL_PGID = getpgrp())) {
+    kill(-SHELL_PGID, SIGTTIN);
   }
 
-  return *linePtr;
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+  signal(SIGTSTP, SIG_IGN);
+  signal(SIGTTIN, SIG_IGN);
+  signal(SIGTTOU, SIG_IGN);
+
+  if (getpid() != SHELL_PGID && setpgid(0, 0) == 0) {
+    SHELL_PGID = getpid();
+  }
+  tcsetpgrp(STDIN_FILENO, SHELL_PGID);
+  tcgetattr(STDIN_FILENO, &SHELL_TMODES);
+  JOB_CONTROL = true;
 }
 
-char* preprocessLine(char **linePtr){
-  char *line = *linePtr;
-  logPrint("Starting line: '%s'\n", line);
+// Put a freshly forked child in its group, and restore what the shell ignores
+void enterProcessGroup(ProcessGroup *pg) {
+  if (JOB_CONTROL || pg->isolated) {
+    setpgid(0, pg->pgid);
+  }
+  if (JOB_CONTROL) {
+    if (pg->foreground) {
+      tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+  }
+  resetChildSignals();
+}
 
-  if (replaceBangs(&line) == NULL) {
-    logPrint("replaceBangs failed\n");
-    return NULL;
+// Called by the shell too, so the group exists whichever side runs first
+void joinProcessGroup(Process *p, ProcessGroup *pg) {
+  if (!JOB_CONTROL && !pg->isolated) {
+    return;
+  }
+  if (pg->pgid == 0) {
+    pg->pgid = p->pid;
   }
-  logPrint("Line after replaceBangs: '%s'\n", line);
+  setpgid(p->pid, pg->pgid);
+}
 
-  if (saveCommandToHistory(line) < 0) {
-    logPrint("saveCommandToHistory failed\n");
-    return NULL;
+void giveTerminalTo(pid_t pgid, struct termios *tmodes) {
+  if (!JOB_CONTROL) {
+    return;
   }
+  tcsetpgrp(STDIN_FILENO, pgid);
+  if (tmodes != NULL) {
+    tcsetattr(STDIN_FILENO, TCSADRAIN, tmodes);
+  }
+}
 
-  char *newline = calloc(strlen(line) + 1, sizeof(char));
-  int index = 0;
-
-  char prevc = 0;
-  char currc = 0;
-  char nextc = line[0];
-  for (int i = 0; (currc = line[i]); i++) {
-    prevc = newline[index-1];
-    nextc = line[i+1];
-
-    switch (currc) {
-      // Don't need to include case for \n since it was stripped in
-      // replaceBangs
-      case '\t':
-        currc = ' ';
-      case ' ':
-        // ignore space if it's the beginning/end of the line 
-        // or if previous or next character makes it redundant
-        if (
-          index == 0 || 
-          charInString(prevc, "|&<>") || 
-          charInString(nextc, " \t\n|&<>\0")
-        ){
-          continue;
-        }
-        newline[index++] = currc;
-        break;
-      case '|':
-      case '<':
-      case '>':
-        if (index == 0) {
-          logPrint("Syntax Error: %c found at beginning of line\n", currc);
-          printError();
-          return NULL;
-        }
-      case '&':
-        if (charInString(prevc, "|&<>")){
-          logPrint("Syntax Error: %c found after %c\n", currc, prevc);
-          printError();
-          free(newline);
-          return NULL;
-        }
-        newline[index++] = currc;
-        break;
-      default:
-        newline[index++] = currc;
+void describeGroup(ProcessGroup *pg, char *buf, size_t size) {
+  size_t used = 0;
+  buf[0] = '\0';
+  for (int i = 0; i < pg->nprocesses && used < size; i++) {
+    Process *p = &pg->processes[i];
+    if (i > 0) {
+      used += snprintf(buf + used, size - used, " | ");
+    }
+    for (int j = 0; j < p->nargs && used < size; j++) {
+      used += snprintf(buf + used, size - used, j ? " %s" : "%s", p->args[j]);
+    }
+    if (p->rfin != NULL && used < size) {
+      used += snprintf(buf + used, size - used, " < %s", p->rfin);
+    }
+    if (p->here != NULL && used < size) {
+      used += snprintf(buf + used, size - used, " %s %s",
+        p->hereString ? "<<<" : "<<", p->here);
+    }
+    if (p->rfout != NULL && used < size) {
+      used += snprintf(buf + used, size - used, " > %s", p->rfout);
     }
   }
-  
-  if (charInString(newline[strlen(newline)-1], "|<>")) {
-    logPrint("Invalid token at end of line: %c\n", newline[strlen(newline)-1]);
-    printError();
-    free(newline);
-    return NULL;
+}
+
+Job *makeJob(ProcessGroup *pg, bool stopped) {
+  Job *job = calloc(1, sizeof(*job));
+  char command[MAX_PATH];
+  describeGroup(pg, command, sizeof(command));
+  job->command = strdup(command);
+  job->state = stopped ? JOB_STOPPED : JOB_RUNNING;
+
+  // The line's arena is about to be reset, so keep our own copy of the
+  // processes and point the reaper at it
+  job->group = *pg;
+  job->group.processes = malloc(sizeof(Process) * pg->nprocesses);
+  memcpy(job->group.processes, pg->processes, sizeof(Process) * pg->nprocesses);
+  for (int i = 0; i < pg->nprocesses; i++) {
+    Process *p = &job->group.processes[i];
+    p->args = NULL;
+    p->rfin = NULL;
+    p->rfout = NULL;
+    p->here = NULL;
+    p->hereFd = -1;
+    if (p->executed && !p->reaped && p->pid > 0) {
+      Child *c = findChildSlot(CHILDREN, CHILDREN_SIZE, p->pid);
+      c->p = p;
+      c->pg = &job->group;
+    }
+  }
+  for (BuiltInThread *t = THREADS; t != NULL; t = t->next) {
+    if (t->pg == pg) {
+      t->p = &job->group.processes[t->p - pg->processes];
+      t->pg = &job->group;
+    }
   }
-  logPrint("Ending line: %s\n", newline);
 
-  *linePtr = malloc(sizeof(char) * (strlen(newline) + 1));
-  if (strcpy(*linePtr, newline) == NULL) {
-    logPrint("Error copying stripped line\n");
-    exit(1);
+  // Number jobs from one past the highest in use, like other shells
+  Job **tail = &JOBS;
+  job->id = 1;
+  for (; *tail != NULL; tail = &(*tail)->next) {
+    job->id = (*tail)->id + 1;
   }
-  free(newline);
-  return *linePtr;
+  *tail = job;
+  return job;
 }
 
-void initializeProcess(Process *p, int id){
-  p->pid = id;
-  p->nargs = 0;
-  p->executed = false;
-  p->args = NULL;
-  p->rfin = NULL;
-  p->rfout = NULL;
+void freeJob(Job *job) {
+  for (Job **j = &JOBS; *j != NULL; j = &(*j)->next) {
+    if (*j == job) {
+      *j = job->next;
+      break;
+    }
+  }
+  free(job->group.processes);
+  free(job->command);
+  free(job);
 }
 
-void initializeProcessGroup(ProcessGroup *pg, int id) {
-  pg->pgid = id;
-  pg->run = false;
-  pg->background = true;
-  pg->nprocesses = 0;
-  pg->processes = NULL;
+// Builtin threads can't be stopped, so a group is stopped once all of
+// its processes are
+bool groupStopped(ProcessGroup *pg) {
+  int processes = pg->running - pg->threads;
+  return processes > 0 && pg->stopped == processes;
 }
 
-int saveToken(Process *p, char *token, state s) {
-  switch (s) {
-    case ARGUMENT:
-      if ((p->args[p->nargs++] = strdup(token)) == NULL) {
-        logPrint("Failed to save token: %s\n", token);
-        exit(1);
-      }
-      break;
-    case RFIN:
-      if (p->rfin != NULL) {
-        logPrint("Trying to save second rfin: %s->%s\n", p->rfin, token);
-        printError();
-        return -1;
+/*
+  Wait for a group that holds the terminal. Returns true if it stopped
+  rather than finished.
+*/
+bool waitForeground(ProcessGroup *pg) {
+  while (pg->running > 0 && !(JOB_CONTROL && groupStopped(pg))) {
+    waitForEvents();
+  }
+  return pg->running > 0;
+}
+
+void continueGroup(ProcessGroup *pg) {
+  for (int i = 0; i < pg->nprocesses; i++) {
+    pg->processes[i].stopped = false;
+  }
+  pg->stopped = 0;
+  if (pg->pgid > 0) {
+    kill(-pg->pgid, SIGCONT);
+  }
+  else {
+    for (int i = 0; i < pg->nprocesses; i++) {
+      Process *p = &pg->processes[i];
+      if (p->executed && !p->reaped && p->pid > 0) {
+        kill(p->pid, SIGCONT);
       }
-      p->rfin = strdup(token);
-      break;
-    case RFOUT:
-      if (p->rfout != NULL) {
-        logPrint("Trying to save second rfout: %s->%s\n", p->rfout, token);
-        printError();
-        return -1;
+    }
+  }
+}
+
+// Report jobs that finished or stopped since the last prompt
+void notifyJobs() {
+  if (EVENT_FD >= 0) {
+    reapChildren();
+  }
+  for (Job *job = JOBS, *next; job != NULL; job = next) {
+    next = job->next;
+    if (job->group.running == 0) {
+      printf("[%d]  Done\t\t%s\n", job->id, job->command);
+      freeJob(job);
+    }
+    else if (groupStopped(&job->group) && job->state != JOB_STOPPED) {
+      job->state = JOB_STOPPED;
+      printf("[%d]  Stopped\t\t%s\n", job->id, job->command);
+    }
+  }
+}
+
+Job *findJob(int nargs, char **args) {
+  if (nargs > 2) {
+    return NULL;
+  }
+  Job *last = NULL;
+  for (Job *job = JOBS; job != NULL; job = job->next) {
+    if (nargs == 2) {
+      char *spec = args[1][0] == '%' ? args[1] + 1 : args[1];
+      if (atoi(spec) == job->id) {
+        return job;
       }
-      p->rfout = strdup(token);
-      break;
-    case END:
-      logPrint("Attempting to save token during END state: %s\n", token);
-      exit(1);
-    default:
-      logPrint("Encountered unknown state: %i\n", s);
-      exit(1);
+    }
+    last = job;
   }
-  return 0;
+  return nargs == 2 ? NULL : last;
 }
 
-int changeState(state *s, char delim, Process *p) {
-  switch(delim) {
-    case ' ':
-      if (*s == RFIN || *s == RFOUT) {
-        logPrint("Error: Trying to add argument after redirect\n");
-        printError();
-        return -1;
+int jobs(int nargs, char **args, int in, int out) {
+  if (nargs != 1) {
+    printError();
+    return -1;
+  }
+  if (EVENT_FD >= 0) {
+    reapChildren();
+  }
+  for (Job *job = JOBS, *next; job != NULL; job = next) {
+    next = job->next;
+    char *state = job->group.running == 0 ? "Done"
+      : groupStopped(&job->group) ? "Stopped" : "Running";
+    dprintf(out, "[%d]  %-8s\t%s\n", job->id, state, job->command);
+    if (job->group.running == 0) {
+      freeJob(job);
+    }
+  }
+  return 0;
+}
+
+int fg(int nargs, char **args, int in, int out) {
+  Job *job = findJob(nargs, args);
+  if (job == NULL) {
+    printError();
+    return -1;
+  }
+
+  dprintf(out, "%s\n", job->command);
+  fflush(stdout);
+  giveTerminalTo(job->group.pgid, job->hasTmodes ? &job->tmodes : NULL);
+  continueGroup(&job->group);
+  job->state = JOB_RUNNING;
+
+  bool stopped = waitForeground(&job->group);
+  if (JOB_CONTROL) {
+    if (stopped) {
+      tcgetattr(STDIN_FILENO, &job->tmodes);
+      job->hasTmodes = true;
+    }
+    giveTerminalTo(SHELL_PGID, &SHELL_TMODES);
+  }
+  if (stopped) {
+    job->state = JOB_STOPPED;
+    dprintf(out, "\n[%d]  Stopped\t\t%s\n", job->id, job->command);
+  }
+  else {
+    freeJob(job);
+  }
+  return 0;
+}
+
+int bg(int nargs, char **args, int in, int out) {
+  Job *job = findJob(nargs, args);
+  if (job == NULL) {
+    printError();
+    return -1;
+  }
+  continueGroup(&job->group);
+  job->state = JOB_RUNNING;
+  dprintf(out, "[%d]  %s &\n", job->id, job->command);
+  return 0;
+}
+
+int waitJobs(int nargs, char **args, int in, int out) {
+  Job *only = NULL;
+  if (nargs > 1 && (only = findJob(nargs, args)) == NULL) {
+    printError();
+    return -1;
+  }
+
+  for (Job *job = JOBS, *next; job != NULL; job = next) {
+    next = job->next;
+    if (only != NULL && job != only) {
+      continue;
+    }
+    // Stopped jobs would never finish, so don't wait on them
+    while (job->group.running > 0 && !groupStopped(&job->group)) {
+      waitForEvents();
+    }
+    if (job->group.running == 0) {
+      freeJob(job);
+    }
+  }
+  return 0;
+}
+
+void printProcess(Process *p){
+
+  logPrint("Process %d:\n", p->pid);
+  logPrint("\tNumber of Arguments: %d\n", p->nargs);
+  logPrint("\tArguments:\n");
+  for (int i = 0; i < p->nargs; i++){
+    logPrint("\t\t%s\n", p->args[i]);
+  }
+  logPrint("\tInput File: %s\n", p->rfin);
+  logPrint("\tOutput File: %s\n", p->rfout);
+}
+
+void printProcessGroup(ProcessGroup *pg){
+  logPrint("Process Group %d (pgid %d):\n", pg->id, pg->pgid);
+  logPrint("\tBackground? %s\n", pg->background ? "yes" : "no");
+  logPrint("\tNumber of Processes: %d\n", pg->nprocesses);
+  logPrint("\tProcesses:\n")
+  for (int i = 0; i < pg->nprocesses; i++) {
+    printProcess(&(pg->processes[i]));
+  }
+}
+
+/*
+  Bump-pointer arena for everything parsed out of a single line.
+  Chunks are kept across resets, so once the arena has grown to fit
+  the largest line seen, parsing a line does no heap allocation.
+*/
+ArenaChunk *newArenaChunk(size_t size) {
+  ArenaChunk *c = malloc(sizeof(*c) + size);
+  if (c == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  c->next = NULL;
+  c->size = size;
+  c->used = 0;
+  STATS.arenaChunks++;
+  logPrint("Allocated arena chunk of %zu bytes\n", size);
+  return c;
+}
+
+void *arenaAlloc(Arena *a, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (a->current == NULL) {
+    a->head = a->current = newArenaChunk(size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+  }
+
+  ArenaChunk *c = a->current;
+  if (c->size - c->used < size) {
+    // Reuse the next chunk from a previous line if it is big enough,
+    // otherwise splice a new one in after the current chunk
+    if (c->next != NULL && c->next->size >= size) {
+      c = c->next;
+    }
+    else {
+      size_t chunkSize = c->size * 2 > size ? c->size * 2 : size;
+      ArenaChunk *n = newArenaChunk(chunkSize);
+      n->next = c->next;
+      c->next = n;
+      c = n;
+    }
+    c->used = 0;
+    a->current = c;
+  }
+
+  void *ptr = c->data + c->used;
+  c->used += size;
+  a->used += size;
+  a->last = ptr;
+  return ptr;
+}
+
+void *arenaRealloc(Arena *a, void *ptr, size_t oldSize, size_t newSize) {
+  // Grow in place if ptr was the last thing allocated and there's room
+  ArenaChunk *c = a->current;
+  if (ptr != NULL && ptr == a->last) {
+    size_t start = (char *)ptr - c->data;
+    size_t aligned = (newSize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (start + aligned <= c->size) {
+      a->used += start + aligned - c->used;
+      c->used = start + aligned;
+      return ptr;
+    }
+  }
+
+  void *newPtr = arenaAlloc(a, newSize);
+  if (ptr != NULL) {
+    memcpy(newPtr, ptr, oldSize < newSize ? oldSize : newSize);
+  }
+  return newPtr;
+}
+
+char *arenaStrndup(Arena *a, const char *s, size_t n) {
+  char *copy = arenaAlloc(a, n + 1);
+  memcpy(copy, s, n);
+  copy[n] = '\0';
+  return copy;
+}
+
+char *arenaStrdup(Arena *a, const char *s) {
+  return arenaStrndup(a, s, strlen(s));
+}
+
+void arenaReset(Arena *a) {
+  if (a->used > STATS.arenaPeakBytes) {
+    STATS.arenaPeakBytes = a->used;
+  }
+  STATS.arenaResets++;
+  a->current = a->head;
+  if (a->current != NULL) {
+    a->current->used = 0;
+  }
+  a->used = 0;
+  a->last = NULL;
+}
+
+bool charInString(char a, char *s){
+  char b;
+  for (int i = 0; (b = s[i]); i++) {
+    if (a == b) {
+      return true;
+    }
+  }
+  return false;
+}
+
+char *historyEntry(int event, size_t *len) {
+  int i = event - HISTORY.base - 1;
+  if (i < 0 || i >= HISTORY.count) {
+    return NULL;
+  }
+  size_t end = i + 1 < HISTORY.count ? HISTORY.offsets[i+1] : HISTORY.used;
+  if (len != NULL) {
+    *len = end - HISTORY.offsets[i] - 1;
+  }
+  return HISTORY.buf + HISTORY.offsets[i];
+}
+
+int lastHistoryEvent() {
+  return HISTORY.base + HISTORY.count;
+}
+
+// The top half of the product, since its low bits only mix the last byte
+size_t postingSlot(uint32_t key) {
+  return ((uint64_t)key * 0x9e3779b97f4a7c15ull) >> 32 & (HISTORY_INDEX.size - 1);
+}
+
+// Key 0 marks an empty slot, so trigrams are stored one up
+Posting *findPosting(uint32_t gram, bool create) {
+  HistoryIndex *h = &HISTORY_INDEX;
+  if (create && (h->used + 1) * 2 > h->size) {
+    Posting *old = h->table;
+    size_t oldSize = h->size;
+    h->size = oldSize == 0 ? 4096 : oldSize * 2;
+    h->table = calloc(h->size, sizeof(Posting));
+    for (size_t i = 0; i < oldSize; i++) {
+      if (old[i].key != 0) {
+        size_t j = postingSlot(old[i].key);
+        while (h->table[j].key != 0) {
+          j = (j + 1) & (h->size - 1);
+        }
+        h->table[j] = old[i];
       }
-      *s = ARGUMENT;
-      break;
-    case '<':
-      if (p->rfin != NULL) {
-        logPrint("Error: Attempting multiple redirect in\n");
-        printError();
-        return -1;
+    }
+    free(old);
+  }
+  if (h->size == 0) {
+    return NULL;
+  }
+
+  uint32_t key = gram + 1;
+  size_t i = postingSlot(key);
+  for (; h->table[i].key != 0; i = (i + 1) & (h->size - 1)) {
+    if (h->table[i].key == key) {
+      return &h->table[i];
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  h->used++;
+  h->table[i].key = key;
+  return &h->table[i];
+}
+
+void putVarint(Posting *p, unsigned int value) {
+  if (p->len + 5 > p->cap) {
+    p->cap = p->cap == 0 ? 8 : p->cap * 2;
+    p->deltas = realloc(p->deltas, p->cap);
+  }
+  while (value >= 0x80) {
+    p->deltas[p->len++] = value | 0x80;
+    value >>= 7;
+  }
+  p->deltas[p->len++] = value;
+}
+
+unsigned int getVarint(unsigned char *bytes, size_t *pos) {
+  unsigned int value = 0;
+  for (int shift = 0; ; shift += 7) {
+    unsigned char b = bytes[(*pos)++];
+    value |= (unsigned int)(b & 0x7f) << shift;
+    if (b < 0x80) {
+      return value;
+    }
+  }
+}
+
+/*
+  Step back from the entry whose delta ends at *pos: only the last byte
+  of a varint has its top bit clear, so its first byte is found by
+  looking back for the previous one that does
+*/
+int previousPosting(Posting *p, size_t *pos, int event) {
+  size_t start = *pos - 1;
+  while (start > 0 && p->deltas[start - 1] >= 0x80) {
+    start--;
+  }
+  size_t at = start;
+  event -= getVarint(p->deltas, &at);
+  *pos = start;
+  return event;
+}
+
+void indexEntry(int event, char *entry, size_t len) {
+  // The entry behind two newlines, a trigram at a time
+  uint32_t gram = '\n' << 8 | '\n';
+  for (size_t i = 0; i < len; i++) {
+    gram = (gram << 8 | (unsigned char)entry[i]) & 0xffffff;
+    Posting *p = findPosting(gram, true);
+    if (p->last == event) {
+      continue;
+    }
+    putVarint(p, event - p->last);
+    p->last = event;
+    p->count++;
+  }
+}
+
+void catchUpIndex() {
+  HistoryIndex *h = &HISTORY_INDEX;
+  int event = h->indexed > HISTORY.base ? h->indexed + 1 : HISTORY.base + 1;
+  for (; event <= HISTORY.base + HISTORY.count; event++) {
+    int i = event - HISTORY.base - 1;
+    size_t end = i + 1 < HISTORY.count ? HISTORY.offsets[i+1] : HISTORY.used;
+    indexEntry(event, HISTORY.buf + HISTORY.offsets[i], end - HISTORY.offsets[i] - 1);
+  }
+  h->indexed = event - 1;
+}
+
+// Drop the events history no longer holds from every list
+void pruneIndex() {
+  HistoryIndex *h = &HISTORY_INDEX;
+  for (size_t i = 0; i < h->size; i++) {
+    Posting *p = &h->table[i];
+    if (p->key == 0 || p->count == 0) {
+      continue;
+    }
+    if (p->last <= HISTORY.base) {
+      p->len = p->count = p->last = 0;
+      continue;
+    }
+    size_t pos = 0;
+    int event = 0;
+    int dropped = 0;
+    for (size_t next = 0; event <= HISTORY.base; pos = next, dropped++) {
+      event += getVarint(p->deltas, &next);
+    }
+    if (dropped == 1) {
+      continue;
+    }
+    // The first event left becomes absolute again
+    size_t rest = p->len - pos;
+    unsigned char *tail = malloc(rest);
+    memcpy(tail, p->deltas + pos, rest);
+    p->len = 0;
+    putVarint(p, event);
+    memcpy(p->deltas + p->len, tail, rest);
+    p->len += rest;
+    p->count -= dropped - 1;
+    free(tail);
+  }
+}
+
+bool entryMatches(char *entry, size_t len, char *query, size_t qlen, bool prefix) {
+  if (prefix) {
+    return len >= qlen && memcmp(entry, query, qlen) == 0;
+  }
+  return qlen == 0 || memmem(entry, len, query, qlen) != NULL;
+}
+
+/*
+  The newest event before `before` that contains query, or starts with
+  it for a prefix search; 0 if there is none. Only the rarest of the
+  query's trigrams is walked, and each event on it is checked against
+  the entry itself. Queries too short to have a trigram scan the
+  history from the end instead, where they usually match quickly.
+*/
+int searchHistory(char *query, size_t qlen, bool prefix, int before) {
+  HistoryIndex *h = &HISTORY_INDEX;
+  h->searches++;
+  if (before > lastHistoryEvent() + 1) {
+    before = lastHistoryEvent() + 1;
+  }
+
+  size_t glen = qlen + (prefix ? 2 : 0);
+  if (glen < 3) {
+    for (int event = before - 1; event > HISTORY.base; event--) {
+      size_t len;
+      char *entry = historyEntry(event, &len);
+      h->candidates++;
+      if (entryMatches(entry, len, query, qlen, prefix)) {
+        return event;
       }
-      else if (p->nargs == 0) {
-        logPrint("Error: No command before redirection\n");
-        printError();
+    }
+    return 0;
+  }
+
+  catchUpIndex();
+  Posting *rarest = NULL;
+  uint32_t gram = '\n' << 8 | '\n';
+  for (size_t i = 0; i < qlen; i++) {
+    gram = (gram << 8 | (unsigned char)query[i]) & 0xffffff;
+    if (i + (prefix ? 2 : 0) < 2) {
+      continue;
+    }
+    Posting *p = findPosting(gram, false);
+    if (p == NULL || p->count == 0) {
+      return 0;
+    }
+    if (rarest == NULL || p->count < rarest->count) {
+      rarest = p;
+    }
+  }
+
+  size_t pos = rarest->len;
+  for (int event = rarest->last; pos > 0 && event > HISTORY.base; ) {
+    if (event < before) {
+      size_t len;
+      char *entry = historyEntry(event, &len);
+      h->candidates++;
+      if (entryMatches(entry, len, query, qlen, prefix)) {
+        return event;
+      }
+    }
+    event = previousPosting(rarest, &pos, event);
+  }
+  return 0;
+}
+
+/*
+  Forget the oldest entries once the store holds a quarter more than
+  the limit, so trimming is amortized over many appends
+*/
+void trimHistory() {
+  if (HISTORY.count <= HISTORY.limit + HISTORY.limit / 4) {
+    return;
+  }
+  int drop = HISTORY.count - HISTORY.limit;
+  size_t shift = HISTORY.offsets[drop];
+  memmove(HISTORY.buf, HISTORY.buf + shift, HISTORY.used - shift);
+  HISTORY.used -= shift;
+  for (int i = drop; i < HISTORY.count; i++) {
+    HISTORY.offsets[i - drop] = HISTORY.offsets[i] - shift;
+  }
+  HISTORY.count -= drop;
+  HISTORY.base += drop;
+  if (HISTORY_INDEX.indexed > 0) {
+    pruneIndex();
+  }
+  logPrint("Dropped %d history entries\n", drop);
+}
+
+void appendHistory(char *line, size_t len) {
+  if (HISTORY.used + len + 1 > HISTORY.cap) {
+    size_t cap = HISTORY.cap == 0 ? 4096 : HISTORY.cap;
+    while (cap < HISTORY.used + len + 1) {
+      cap *= 2;
+    }
+    HISTORY.buf = realloc(HISTORY.buf, cap);
+    HISTORY.cap = cap;
+  }
+  if (HISTORY.count == HISTORY.maxEntries) {
+    HISTORY.maxEntries = HISTORY.maxEntries == 0 ? 256 : HISTORY.maxEntries * 2;
+    HISTORY.offsets = realloc(HISTORY.offsets, sizeof(*HISTORY.offsets) * HISTORY.maxEntries);
+  }
+
+  HISTORY.offsets[HISTORY.count++] = HISTORY.used;
+  memcpy(HISTORY.buf + HISTORY.used, line, len);
+  HISTORY.buf[HISTORY.used + len] = '\0';
+  HISTORY.used += len + 1;
+  trimHistory();
+}
+
+int saveCommandToHistory(char *line, size_t len) {
+  logPrint("Current History (n=%d)\n", lastHistoryEvent());
+
+  size_t lastlen;
+  char *last = historyEntry(lastHistoryEvent(), &lastlen);
+  if (
+    HISTORY.limit == 0 ||
+    len == 0 ||
+    charInString(line[0], " \t\n") ||
+    (last != NULL && lastlen == len && memcmp(line, last, len) == 0)
+  ) {
+    return 0;
+  }
+
+  appendHistory(line, len);
+
+  if (HISTORY.fd >= 0) {
+    struct iovec iov[2] = {{line, len}, {"\n", 1}};
+    if (writev(HISTORY.fd, iov, 2) < 0) {
+      logPrint("Failed to append to history file: %s\n", strerror(errno));
+    }
+  }
+  return 0;
+}
+
+/*
+  Load the history file by mapping it rather than reading it line by
+  line. Only the newest HISTORY.limit entries are kept.
+*/
+void loadHistory(char *file) {
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  bool compact = false;
+
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      char *end = map + st.st_size;
+      char *start = end;
+
+      // Walk back from the end to find where the newest entries begin
+      char *ptr = end[-1] == '\n' ? end - 1 : end;
+      for (int nlines = 0; ptr > map && nlines < HISTORY.limit; nlines++) {
+        char *nl = memrchr(map, '\n', ptr - map);
+        start = nl == NULL ? map : nl + 1;
+        ptr = nl == NULL ? map : nl;
+      }
+      compact = start - map > end - start;
+
+      for (ptr = start; ptr < end; ) {
+        char *nl = memchr(ptr, '\n', end - ptr);
+        size_t len = (nl == NULL ? end : nl) - ptr;
+        if (len > 0) {
+          appendHistory(ptr, len);
+        }
+        ptr += len + 1;
+      }
+      munmap(map, st.st_size);
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  // Rewrite the file once most of it is entries we no longer keep
+  if (compact) {
+    char tmp[MAX_PATH];
+    snprintf(tmp, MAX_PATH, "%s.%d", file, getpid());
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (out >= 0) {
+      char *data = HISTORY.buf;
+      for (size_t i = 0; i < HISTORY.used; i++) {
+        if (data[i] == '\0') {
+          data[i] = '\n';
+        }
+      }
+      bool ok = write(out, data, HISTORY.used) == (ssize_t)HISTORY.used;
+      for (size_t i = 0; i < HISTORY.used; i++) {
+        if (data[i] == '\n') {
+          data[i] = '\0';
+        }
+      }
+      close(out);
+      if (!ok || rename(tmp, file) != 0) {
+        unlink(tmp);
+      }
+      logPrint("Compacted history file %s\n", file);
+    }
+  }
+
+  HISTORY.fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (HISTORY.fd < 0) {
+    logPrint("Cannot open history file %s: %s\n", file, strerror(errno));
+  }
+}
+
+void initHistory(bool interactive) {
+  HISTORY.fd = -1;
+  HISTORY.limit = HISTORY_DEFAULT_SIZE;
+
+  char *size = getenv("WISH_HISTSIZE");
+  if (size != NULL && *size != '\0') {
+    HISTORY.limit = atoi(size) < 0 ? 0 : atoi(size);
+  }
+
+  // Only interactive shells keep a history file unless asked for one
+  char *file = getenv("WISH_HISTFILE");
+  char defaultFile[MAX_PATH];
+  if (file == NULL && interactive && getenv("HOME") != NULL) {
+    snprintf(defaultFile, MAX_PATH, "%s/.wish_history", getenv("HOME"));
+    file = defaultFile;
+  }
+  if (file != NULL && *file != '\0' && HISTORY.limit > 0) {
+    loadHistory(file);
+  }
+}
+
+/*
+  Find the event a history designator starting at bang refers to: !N,
+  !prefix for the newest entry starting with prefix, or !?text? for the
+  newest containing text (the closing ? may be left off at the end of
+  the line). *after is set to the first char past it. Returns 0 when
+  the bang isn't a designator and -1 when it names no event.
+*/
+int findEvent(char *line, char *bang, char *end, char **after) {
+  char *start = bang + 1;
+  if (start == end || charInString(*start, " \t!=()") || (bang > line && bang[-1] == '[')) {
+    return 0;
+  }
+
+  if (isdigit((unsigned char)*start)) {
+    int event = 0;
+    char *numptr = start;
+    for (; numptr < end && isdigit((unsigned char)*numptr); numptr++) {
+      if (numptr - bang > 9) {
+        logPrint("Event out of range: Max digits is 9\n");
         return -1;
       }
-      *s = RFIN;
-      break;
-    case '>':
-      if (p->rfout != NULL) {
-        logPrint("Error: Attempting multiple redirect out\n");
-        printError();
-        return -1;
+      event = event * 10 + (*numptr - '0');
+    }
+    *after = numptr;
+    if (historyEntry(event, NULL) == NULL) {
+      logPrint("Event out of range: !%d [%d-%d]\n", event, HISTORY.base + 1, lastHistoryEvent());
+      return -1;
+    }
+    return event;
+  }
+
+  bool prefix = *start != '?';
+  char *text = prefix ? start : start + 1;
+  char *stop = text;
+  while (stop < end && (prefix ? !charInString(*stop, " \t;&|<>()") : *stop != '?')) {
+    stop++;
+  }
+  *after = prefix || stop == end ? stop : stop + 1;
+  int event = stop > text ? searchHistory(text, stop - text, prefix, lastHistoryEvent() + 1) : 0;
+  if (event == 0) {
+    logPrint("Event not found: %.*s\n", (int)(*after - bang), bang);
+    return -1;
+  }
+  return event;
+}
+
+/*
+  Replace each history designator in the first len chars of *linePtr
+  with the entry it refers to. The line is only copied if it actually
+  contains one, and every character is visited once.
+*/
+int expandHistory(Arena *a, char **linePtr, size_t *lenPtr) {
+  char *line = *linePtr;
+  size_t len = *lenPtr;
+  char *bang = memchr(line, '!', len);
+  if (bang == NULL) {
+    return 0;
+  }
+
+  size_t cap = len + 1;
+  size_t newlen = 0;
+  char *newline = NULL;
+  char *start = line;
+  char *end = line + len;
+
+  for (; bang != NULL; bang = memchr(bang + 1, '!', end - bang - 1)) {
+    char *after;
+    int event = findEvent(line, bang, end, &after);
+    if (event == 0) {
+      logPrint("Ignoring bang not followed by an event\n");
+      continue;
+    }
+    if (event < 0) {
+      printError();
+      return -1;
+    }
+
+    size_t eventlen;
+    char *entry = historyEntry(event, &eventlen);
+    logPrint("Found event %d: '%s'\n", event, entry);
+
+    // Copy everything since the last event, then the event itself
+    size_t need = newlen + (bang - start) + eventlen + (end - after) + 1;
+    if (need > cap || newline == NULL) {
+      size_t newcap = cap * 2 > need ? cap * 2 : need;
+      newline = arenaRealloc(a, newline, cap, newcap);
+      cap = newcap;
+    }
+    memcpy(newline + newlen, start, bang - start);
+    newlen += bang - start;
+    memcpy(newline + newlen, entry, eventlen);
+    newlen += eventlen;
+
+    start = after;
+    bang = after - 1;
+  }
+
+  if (newline == NULL) {
+    return 0;
+  }
+  memcpy(newline + newlen, start, end - start);
+  newlen += end - start;
+  newline[newlen] = '\0';
+
+  if (DEFER_TO != NULL) {
+    DEFER_TO->echo = newline;
+  }
+  else {
+    printf("%s\n", newline);
+  }
+  *linePtr = newline;
+  *lenPtr = newlen;
+  return 0;
+}
+
+/*
+  Line editor for an interactive shell on a terminal. The terminal is
+  only raw while a line is being edited, and keys are read a byte at a
+  time so nothing typed ahead for a command or a here-document is taken
+  from it. Ctrl-R searches the history backwards as the query is typed,
+  through the trigram index, and again from the current match each time
+  it is pressed.
+*/
+typedef enum {
+  KEY_UP = 256,
+  KEY_DOWN,
+  KEY_RIGHT,
+  KEY_LEFT,
+  KEY_HOME,
+  KEY_END,
+  KEY_DELETE,
+  KEY_OTHER,
+} EditorKey;
+
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t cap;
+  size_t pos;
+  // The event shown while browsing with the arrows, 0 for the typed line
+  int browse;
+  char *typed;
+  size_t typedLen;
+  // Reverse search, with the event last found
+  bool searching;
+  bool failed;
+  char query[256];
+  size_t qlen;
+  int match;
+} Editor;
+
+Editor EDITOR;
+
+void editorSet(char *text, size_t len) {
+  if (len + 1 > EDITOR.cap) {
+    EDITOR.cap = len + 1 > EDITOR.cap * 2 ? len + 1 : EDITOR.cap * 2;
+    EDITOR.buf = realloc(EDITOR.buf, EDITOR.cap);
+  }
+  memmove(EDITOR.buf, text, len);
+  EDITOR.len = EDITOR.pos = len;
+}
+
+void editorInsert(char c) {
+  if (EDITOR.len + 2 > EDITOR.cap) {
+    EDITOR.cap = EDITOR.cap == 0 ? 256 : EDITOR.cap * 2;
+    EDITOR.buf = realloc(EDITOR.buf, EDITOR.cap);
+  }
+  memmove(EDITOR.buf + EDITOR.pos + 1, EDITOR.buf + EDITOR.pos, EDITOR.len - EDITOR.pos);
+  EDITOR.buf[EDITOR.pos++] = c;
+  EDITOR.len++;
+}
+
+void editorDelete(size_t from, size_t to) {
+  memmove(EDITOR.buf + from, EDITOR.buf + to, EDITOR.len - to);
+  EDITOR.len -= to - from;
+  EDITOR.pos = from;
+}
+
+// Redraw the whole line in one write and put the cursor back
+void refreshLine(char *prompt) {
+  char head[sizeof(EDITOR.query) + 64];
+  char *text = EDITOR.buf;
+  size_t len = EDITOR.len;
+  size_t cursor = EDITOR.pos;
+  if (EDITOR.searching) {
+    snprintf(head, sizeof(head), "(%sreverse-i-search)`%.*s': ", EDITOR.failed ? "failed " : "",
+      (int)EDITOR.qlen, EDITOR.query);
+    prompt = head;
+    if (EDITOR.match > 0) {
+      text = historyEntry(EDITOR.match, &len);
+      char *at = memmem(text, len, EDITOR.query, EDITOR.qlen);
+      cursor = at == NULL ? 0 : at - text;
+    }
+  }
+
+  size_t plen = strlen(prompt);
+  char *out = malloc(plen + len + 32);
+  size_t used = 0;
+  out[used++] = '\r';
+  memcpy(out + used, prompt, plen);
+  used += plen;
+  memcpy(out + used, text, len);
+  used += len;
+  used += sprintf(out + used, "\x1b[K\r");
+  if (plen + cursor > 0) {
+    used += sprintf(out + used, "\x1b[%zuC", plen + cursor);
+  }
+  if (write(STDOUT_FILENO, out, used) < 0) {
+    logPrint("Failed to redraw the line: %s\n", strerror(errno));
+  }
+  free(out);
+}
+
+// One key, with the escape sequences for arrows and the like decoded
+int readKey() {
+  unsigned char c;
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR) {
+  }
+  if (n <= 0) {
+    return -1;
+  }
+  if (c != '\x1b') {
+    return c;
+  }
+
+  unsigned char seq[3];
+  if (read(STDIN_FILENO, &seq[0], 1) != 1 || (seq[0] != '[' && seq[0] != 'O') ||
+      read(STDIN_FILENO, &seq[1], 1) != 1) {
+    return KEY_OTHER;
+  }
+  if (isdigit(seq[1])) {
+    if (read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~') {
+      return KEY_OTHER;
+    }
+    switch (seq[1]) {
+      case '1': case '7': return KEY_HOME;
+      case '4': case '8': return KEY_END;
+      case '3': return KEY_DELETE;
+    }
+    return KEY_OTHER;
+  }
+  switch (seq[1]) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+  }
+  return KEY_OTHER;
+}
+
+// Up and down walk the history, coming back to what was being typed
+void browseHistory(int key) {
+  int event = EDITOR.browse;
+  if (key == KEY_UP) {
+    event = event == 0 ? lastHistoryEvent() : event - 1;
+    if (event <= HISTORY.base) {
+      return;
+    }
+    if (EDITOR.browse == 0) {
+      EDITOR.typed = realloc(EDITOR.typed, EDITOR.len + 1);
+      memcpy(EDITOR.typed, EDITOR.buf, EDITOR.len);
+      EDITOR.typedLen = EDITOR.len;
+    }
+  }
+  else if (event == 0) {
+    return;
+  }
+  else {
+    event = event < lastHistoryEvent() ? event + 1 : 0;
+  }
+
+  EDITOR.browse = event;
+  size_t len;
+  char *entry = historyEntry(event, &len);
+  if (entry != NULL) {
+    editorSet(entry, len);
+  }
+  else {
+    editorSet(EDITOR.typed, EDITOR.typedLen);
+  }
+}
+
+void searchBefore(int before) {
+  int match = searchHistory(EDITOR.query, EDITOR.qlen, false, before);
+  EDITOR.failed = match == 0;
+  if (match > 0) {
+    EDITOR.match = match;
+  }
+}
+
+/*
+  Handle a key while searching. Returns false for a key that ends the
+  search, after taking the match as the line to go on editing.
+*/
+bool searchKey(int key) {
+  if (key == CTRL('r')) {
+    if (EDITOR.qlen > 0) {
+      searchBefore(EDITOR.match > 0 ? EDITOR.match : lastHistoryEvent() + 1);
+    }
+    return true;
+  }
+  if (key == CTRL('g')) {
+    EDITOR.searching = false;
+    return true;
+  }
+  if (key == 127 || key == CTRL('h')) {
+    if (EDITOR.qlen > 0) {
+      EDITOR.qlen--;
+      EDITOR.match = 0;
+      searchBefore(lastHistoryEvent() + 1);
+    }
+    return true;
+  }
+  // Typing more keeps the current match while it still matches
+  if (key >= ' ' && key < 127 && EDITOR.qlen < sizeof(EDITOR.query)) {
+    EDITOR.query[EDITOR.qlen++] = key;
+    searchBefore(EDITOR.match > 0 ? EDITOR.match + 1 : lastHistoryEvent() + 1);
+    return true;
+  }
+
+  EDITOR.searching = false;
+  size_t len;
+  char *entry = EDITOR.match > 0 ? historyEntry(EDITOR.match, &len) : NULL;
+  if (entry != NULL) {
+    char *at = memmem(entry, len, EDITOR.query, EDITOR.qlen);
+    editorSet(entry, len);
+    EDITOR.pos = at == NULL ? len : (size_t)(at - entry);
+  }
+  return false;
+}
+
+/*
+  Read a line from the terminal, printing prompt first. The line stays
+  valid until the next call. Returns -1 at end of input.
+*/
+int editLine(char *prompt, char **line, size_t *len) {
+  fflush(stdout);
+  struct termios raw = SHELL_TMODES;
+  raw.c_iflag &= ~(ICRNL | IXON);
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+  EDITOR.len = EDITOR.pos = 0;
+  EDITOR.browse = 0;
+  EDITOR.searching = false;
+  int result = 0;
+  refreshLine(prompt);
+
+  while (1) {
+    int key = readKey();
+    if (key < 0) {
+      result = -1;
+      break;
+    }
+    if (EDITOR.searching && searchKey(key)) {
+      refreshLine(prompt);
+      continue;
+    }
+
+    if (key == '\r' || key == '\n') {
+      break;
+    }
+    switch (key) {
+      case CTRL('d'):
+        if (EDITOR.len == 0) {
+          result = -1;
+          break;
+        }
+        // fall through
+      case KEY_DELETE:
+        if (EDITOR.pos < EDITOR.len) {
+          editorDelete(EDITOR.pos, EDITOR.pos + 1);
+        }
+        break;
+      case 127:
+      case CTRL('h'):
+        if (EDITOR.pos > 0) {
+          editorDelete(EDITOR.pos - 1, EDITOR.pos);
+        }
+        break;
+      case CTRL('c'):
+        if (write(STDOUT_FILENO, "^C\n", 3) < 0) {
+          logPrint("Failed to echo ^C: %s\n", strerror(errno));
+        }
+        EDITOR.len = EDITOR.pos = 0;
+        EDITOR.browse = 0;
+        break;
+      case CTRL('a'):
+      case KEY_HOME:
+        EDITOR.pos = 0;
+        break;
+      case CTRL('e'):
+      case KEY_END:
+        EDITOR.pos = EDITOR.len;
+        break;
+      case CTRL('b'):
+      case KEY_LEFT:
+        EDITOR.pos -= EDITOR.pos > 0;
+        break;
+      case CTRL('f'):
+      case KEY_RIGHT:
+        EDITOR.pos += EDITOR.pos < EDITOR.len;
+        break;
+      case CTRL('k'):
+        EDITOR.len = EDITOR.pos;
+        break;
+      case CTRL('u'):
+        editorDelete(0, EDITOR.pos);
+        break;
+      case CTRL('w'): {
+        size_t from = EDITOR.pos;
+        while (from > 0 && EDITOR.buf[from - 1] == ' ') {
+          from--;
+        }
+        while (from > 0 && EDITOR.buf[from - 1] != ' ') {
+          from--;
+        }
+        editorDelete(from, EDITOR.pos);
+        break;
+      }
+      case CTRL('l'):
+        if (write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7) < 0) {
+          logPrint("Failed to clear the screen: %s\n", strerror(errno));
+        }
+        break;
+      case CTRL('p'):
+      case KEY_UP:
+        browseHistory(KEY_UP);
+        break;
+      case CTRL('n'):
+      case KEY_DOWN:
+        browseHistory(KEY_DOWN);
+        break;
+      case CTRL('r'):
+        EDITOR.searching = true;
+        EDITOR.failed = false;
+        EDITOR.qlen = 0;
+        EDITOR.match = 0;
+        break;
+      default:
+        if (key >= ' ' && key < 256 && key != 127) {
+          editorInsert(key);
+        }
+    }
+    if (result < 0) {
+      break;
+    }
+    refreshLine(prompt);
+  }
+
+  if (write(STDOUT_FILENO, "\n", 1) < 0) {
+    logPrint("Failed to end the line: %s\n", strerror(errno));
+  }
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &SHELL_TMODES);
+  *line = EDITOR.buf;
+  *len = EDITOR.len;
+  return result;
+}
+
+void initializeProcess(Process *p, int id){
+  p->pid = id;
+  p->nargs = 0;
+  p->executed = false;
+  p->reaped = false;
+  p->stopped = false;
+  p->status = 0;
+  memset(&p->rusage, 0, sizeof(p->rusage));
+  memset(&p->started, 0, sizeof(p->started));
+  memset(&p->ended, 0, sizeof(p->ended));
+  p->cpu = -1;
+  p->args = NULL;
+  p->rfin = NULL;
+  p->rfout = NULL;
+  p->here = NULL;
+  p->hereString = false;
+  p->hereFd = -1;
+}
+
+void initializeProcessGroup(ProcessGroup *pg, int id) {
+  pg->id = id;
+  pg->pgid = 0;
+  pg->foreground = false;
+  pg->stopped = 0;
+  pg->threads = 0;
+  pg->run = false;
+  pg->isolated = false;
+  pg->expired = false;
+  pg->launched.tv_sec = 0;
+  pg->launched.tv_nsec = 0;
+  pg->background = true;
+  pg->nprocesses = 0;
+  pg->running = 0;
+  pg->processes = NULL;
+}
+
+int saveToken(Arena *a, Process *p, char *token, int len, state s) {
+  switch (s) {
+    case ARGUMENT:
+      p->args[p->nargs++] = arenaStrndup(a, token, len);
+      break;
+    case RFIN:
+      if (p->rfin != NULL) {
+        logPrint("Trying to save second rfin: %s->%.*s\n", p->rfin, len, token);
+        printError();
+        return -1;
+      }
+      p->rfin = arenaStrndup(a, token, len);
+      break;
+    case RFOUT:
+      if (p->rfout != NULL) {
+        logPrint("Trying to save second rfout: %s->%.*s\n", p->rfout, len, token);
+        printError();
+        return -1;
+      }
+      p->rfout = arenaStrndup(a, token, len);
+      break;
+    case HEREDOC:
+    case HERESTRING:
+      if (p->here != NULL) {
+        logPrint("Trying to save second here text: %s->%.*s\n", p->here, len, token);
+        printError();
+        return -1;
+      }
+      p->here = arenaStrndup(a, token, len);
+      p->hereString = s == HERESTRING;
+      break;
+    case END:
+      logPrint("Attempting to save token during END state: %.*s\n", len, token);
+      exit(1);
+    default:
+      logPrint("Encountered unknown state: %i\n", s);
+      exit(1);
+  }
+  return 0;
+}
+
+int changeState(state *s, char delim, Process *p) {
+  switch(delim) {
+    case ' ':
+      if (*s == RFIN || *s == RFOUT || *s == HEREDOC || *s == HERESTRING) {
+        logPrint("Error: Trying to add argument after redirect\n");
+        printError();
+        return -1;
+      }
+      *s = ARGUMENT;
+      break;
+    case '<':
+    case DELIM_HEREDOC:
+    case DELIM_HERESTRING:
+      // A here-document or here-string is one more way to redirect input
+      if (p->rfin != NULL || p->here != NULL) {
+        logPrint("Error: Attempting multiple redirect in\n");
+        printError();
+        return -1;
+      }
+      else if (p->nargs == 0) {
+        logPrint("Error: No command before redirection\n");
+        printError();
+        return -1;
+      }
+      *s = delim == '<' ? RFIN : delim == DELIM_HEREDOC ? HEREDOC : HERESTRING;
+      break;
+    case '>':
+      if (p->rfout != NULL) {
+        logPrint("Error: Attempting multiple redirect out\n");
+        printError();
+        return -1;
+      }
+      else if (p->nargs == 0) {
+        logPrint("Error: No command before redirection\n");
+        printError();
+        return -1;
+      }
+      *s = RFOUT;
+      break;
+    case 0:
+      if ((*s == RFIN && p->rfin == NULL) || (*s == RFOUT && p->rfout == NULL) ||
+          ((*s == HEREDOC || *s == HERESTRING) && p->here == NULL)) {
+        logPrint("Error: No redirection file specified\n");
+        printError();
+        return -1;
+      }
+      *s = END;
+      break;
+    default:
+      logPrint("Encountered unknown deliminater: %c\n", delim);
+      exit(1);
+  }
+  return 0;
+}
+
+static inline bool isWordChar(char c) {
+  switch (c) {
+    case ' ':
+    case '\t':
+    case '|':
+    case '&':
+    case '<':
+    case '>':
+      return false;
+    default:
+      return true;
+  }
+}
+
+Process *addProcess(Arena *a, ProcessGroup *pg, int *maxProcesses) {
+  // Resize if all of the allocated space has been used up
+  if (pg->nprocesses == *maxProcesses) {
+    *maxProcesses = *maxProcesses == 0 ? 1 : *maxProcesses * 2;
+    pg->processes = arenaRealloc(a, pg->processes,
+      sizeof(*(pg->processes)) * pg->nprocesses,
+      sizeof(*(pg->processes)) * *maxProcesses);
+  }
+  Process *p = &pg->processes[pg->nprocesses];
+  initializeProcess(p, pg->nprocesses);
+  pg->nprocesses++;
+  return p;
+}
+
+/*
+  Globbing. A word with *, ? or [...] in it is replaced by the paths it
+  matches, in sorted order, or left alone if nothing matches. Each
+  component of a pattern is compiled into a small NFA and matched by
+  stepping a bitmask of live states through the name, so matching is
+  linear in the name whatever the pattern looks like.
+*/
+#define GLOB_MAX_TOKENS 63
+#define GLOB_DIRENT_BUFFER (1 << 20)
+#define GLOB_CACHE_DIRS 64
+
+typedef struct {
+  // Bit i of accepts[c] is set when token i can consume c
+  uint64_t accepts[256];
+  // Tokens that are * and so may also consume nothing
+  uint64_t stars;
+  int ntokens;
+  // A leading . in a name has to be matched by a literal .
+  bool dotOk;
+} GlobPattern;
+
+bool hasGlobChars(const char *s, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] == '*' || s[i] == '?' || s[i] == '[') {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Compile one path component; false if it is too long for the bitmask
+bool compileGlob(GlobPattern *g, const char *s, size_t len) {
+  memset(g, 0, sizeof(*g));
+  g->dotOk = len > 0 && s[0] == '.';
+  for (size_t i = 0; i < len; i++) {
+    if (g->ntokens == GLOB_MAX_TOKENS) {
+      return false;
+    }
+    uint64_t bit = 1ULL << g->ntokens++;
+    if (s[i] == '*') {
+      // Runs of * are the same as one
+      if (g->ntokens > 1 && (g->stars & (bit >> 1))) {
+        g->ntokens--;
+        continue;
+      }
+      g->stars |= bit;
+      for (int c = 0; c < 256; c++) {
+        g->accepts[c] |= bit;
+      }
+    }
+    else if (s[i] == '?') {
+      for (int c = 0; c < 256; c++) {
+        g->accepts[c] |= bit;
+      }
+    }
+    else if (s[i] == '[') {
+      size_t j = i + 1;
+      bool negate = j < len && (s[j] == '!' || s[j] == '^');
+      j += negate;
+      bool set[256] = {false};
+      // A ] straight after the [ (or [!) is a member, not the end
+      for (bool first = true; j < len && (first || s[j] != ']'); j++, first = false) {
+        unsigned char lo = s[j];
+        unsigned char hi = lo;
+        if (j + 2 < len && s[j + 1] == '-' && s[j + 2] != ']') {
+          hi = s[j + 2];
+          j += 2;
+        }
+        for (int c = lo; c <= hi; c++) {
+          set[c] = true;
+        }
+      }
+      if (j >= len) {
+        // No closing ], so the [ is just a character
+        g->accepts['['] |= bit;
+        continue;
+      }
+      for (int c = 0; c < 256; c++) {
+        if (set[c] != negate) {
+          g->accepts[c] |= bit;
+        }
+      }
+      i = j;
+    }
+    else {
+      g->accepts[(unsigned char)s[i]] |= bit;
+    }
+  }
+  return true;
+}
+
+static inline uint64_t globClosure(GlobPattern *g, uint64_t states) {
+  // A * that is live may be skipped, which can make the next one live
+  uint64_t prev;
+  do {
+    prev = states;
+    states |= (states & g->stars) << 1;
+  } while (states != prev);
+  return states;
+}
+
+bool matchGlob(GlobPattern *g, const char *name) {
+  if (name[0] == '.' && !g->dotOk) {
+    return false;
+  }
+  uint64_t states = globClosure(g, 1);
+  for (const unsigned char *c = (const unsigned char *)name; *c && states; c++) {
+    uint64_t live = states & g->accepts[*c];
+    // A * consumes the character and stays put; anything else moves on
+    states = globClosure(g, (live & g->stars) | ((live & ~g->stars) << 1));
+  }
+  return (states >> g->ntokens) & 1;
+}
+
+/*
+  Directory listings, read with getdents64 in large batches and kept
+  for the rest of the line. A listing is reused by later lines while
+  the directory's mtime is unchanged, unless the directory changed so
+  shortly before it was read that an update might share its mtime.
+*/
+typedef struct {
+  char *path;
+  struct timespec mtime;
+  ino_t ino;
+  dev_t dev;
+  bool settled;
+  unsigned long line;
+  char *names;
+  int *offsets;
+  unsigned char *types;
+  int count;
+} GlobDir;
+
+GlobDir GLOB_CACHE[GLOB_CACHE_DIRS];
+int GLOB_CACHE_COUNT = 0;
+unsigned long GLOB_LINE = 0;
+
+void freeGlobDir(GlobDir *d) {
+  free(d->path);
+  free(d->names);
+  free(d->offsets);
+  free(d->types);
+  memset(d, 0, sizeof(*d));
+}
+
+bool readGlobDir(GlobDir *d, int fd) {
+  static char *buf = NULL;
+  if (buf == NULL) {
+    buf = malloc(GLOB_DIRENT_BUFFER);
+  }
+  size_t used = 0, cap = 4096;
+  int maxCount = 64;
+  d->names = malloc(cap);
+  d->offsets = malloc(sizeof(int) * maxCount);
+  d->types = malloc(maxCount);
+  d->count = 0;
+
+  ssize_t n;
+  while ((n = getdents64(fd, buf, GLOB_DIRENT_BUFFER)) > 0) {
+    for (ssize_t pos = 0; pos < n; ) {
+      struct dirent64 *e = (struct dirent64 *)(buf + pos);
+      pos += e->d_reclen;
+      if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+        continue;
+      }
+      size_t len = strlen(e->d_name) + 1;
+      if (used + len > cap) {
+        cap = (used + len) * 2;
+        d->names = realloc(d->names, cap);
+      }
+      if (d->count == maxCount) {
+        maxCount *= 2;
+        d->offsets = realloc(d->offsets, sizeof(int) * maxCount);
+        d->types = realloc(d->types, maxCount);
+      }
+      memcpy(d->names + used, e->d_name, len);
+      d->offsets[d->count] = used;
+      d->types[d->count++] = e->d_type;
+      used += len;
+    }
+  }
+  return n == 0;
+}
+
+GlobDir *listGlobDir(const char *path) {
+  struct stat st;
+  if (stat(*path ? path : ".", &st) != 0 || !S_ISDIR(st.st_mode)) {
+    return NULL;
+  }
+
+  GlobDir *d = NULL;
+  for (int i = 0; i < GLOB_CACHE_COUNT; i++) {
+    if (strcmp(GLOB_CACHE[i].path, path) == 0) {
+      d = &GLOB_CACHE[i];
+      break;
+    }
+  }
+  if (d != NULL && (d->line == GLOB_LINE || (d->settled && d->ino == st.st_ino &&
+      d->dev == st.st_dev && d->mtime.tv_sec == st.st_mtim.tv_sec &&
+      d->mtime.tv_nsec == st.st_mtim.tv_nsec))) {
+    d->line = GLOB_LINE;
+    return d;
+  }
+  if (d != NULL) {
+    freeGlobDir(d);
+  }
+  else {
+    if (GLOB_CACHE_COUNT == GLOB_CACHE_DIRS) {
+      // Start over rather than track what was used least
+      for (int i = 0; i < GLOB_CACHE_COUNT; i++) {
+        freeGlobDir(&GLOB_CACHE[i]);
+      }
+      GLOB_CACHE_COUNT = 0;
+    }
+    d = &GLOB_CACHE[GLOB_CACHE_COUNT++];
+  }
+
+  int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (fd < 0 || !readGlobDir(d, fd)) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    freeGlobDir(d);
+    // Keep the cache dense; d is the last slot unless it was a reuse
+    *d = GLOB_CACHE[--GLOB_CACHE_COUNT];
+    memset(&GLOB_CACHE[GLOB_CACHE_COUNT], 0, sizeof(GlobDir));
+    return NULL;
+  }
+  close(fd);
+  d->path = strdup(path);
+  d->mtime = st.st_mtim;
+  d->ino = st.st_ino;
+  d->dev = st.st_dev;
+  d->settled = now.tv_sec > st.st_mtim.tv_sec + 1;
+  d->line = GLOB_LINE;
+  return d;
+}
+
+typedef struct {
+  char **paths;
+  int count;
+  int max;
+} GlobResult;
+
+void addGlobResult(Arena *a, GlobResult *r, const char *path, size_t len) {
+  if (r->count == r->max) {
+    r->max = r->max == 0 ? 64 : r->max * 2;
+    r->paths = realloc(r->paths, sizeof(char *) * r->max);
+  }
+  r->paths[r->count++] = arenaStrndup(a, path, len);
+}
+
+/*
+  Match the components of pattern from rest onwards under the
+  directory prefix (which is empty or ends in /), adding every complete
+  match to r
+*/
+void globFrom(Arena *a, GlobResult *r, char *prefix, size_t prefixLen, const char *rest) {
+  // Components without wildcards are taken as they are
+  const char *end = strchr(rest, '/');
+  while (end != NULL && !hasGlobChars(rest, end - rest)) {
+    size_t len = end - rest + 1;
+    if (prefixLen + len >= MAX_PATH) {
+      return;
+    }
+    memcpy(prefix + prefixLen, rest, len);
+    prefixLen += len;
+    rest = end + 1;
+    end = strchr(rest, '/');
+  }
+  size_t len = end == NULL ? strlen(rest) : (size_t)(end - rest);
+  if (!hasGlobChars(rest, len)) {
+    // Only a literal last component is left, which must exist
+    if (prefixLen + len < MAX_PATH) {
+      memcpy(prefix + prefixLen, rest, len);
+      prefix[prefixLen + len] = '\0';
+      struct stat st;
+      if (lstat(prefix, &st) == 0) {
+        addGlobResult(a, r, prefix, prefixLen + len);
+      }
+    }
+    return;
+  }
+
+  GlobPattern g;
+  bool compiled = compileGlob(&g, rest, len);
+  char component[MAX_PATH];
+  memcpy(component, rest, len);
+  component[len] = '\0';
+
+  prefix[prefixLen] = '\0';
+  GlobDir *d = listGlobDir(prefix);
+  if (d == NULL) {
+    return;
+  }
+  // Copy what we need, since listing deeper directories may evict d
+  int count = d->count;
+  char *names = d->names;
+  int *offsets = d->offsets;
+  unsigned char *types = d->types;
+  bool owned = false;
+  if (end != NULL) {
+    size_t size = count > 0 ? offsets[count - 1] + strlen(names + offsets[count - 1]) + 1 : 0;
+    names = memcpy(malloc(size + 1), d->names, size);
+    offsets = memcpy(malloc(sizeof(int) * (count + 1)), d->offsets, sizeof(int) * count);
+    types = memcpy(malloc(count + 1), d->types, count);
+    owned = true;
+  }
+
+  for (int i = 0; i < count; i++) {
+    char *name = names + offsets[i];
+    bool match = compiled ? matchGlob(&g, name)
+      : fnmatch(component, name, FNM_PERIOD) == 0;
+    if (!match) {
+      continue;
+    }
+    size_t nameLen = strlen(name);
+    if (prefixLen + nameLen + 1 >= MAX_PATH) {
+      continue;
+    }
+    memcpy(prefix + prefixLen, name, nameLen);
+    if (end == NULL) {
+      addGlobResult(a, r, prefix, prefixLen + nameLen);
+    }
+    else if (types[i] == DT_DIR || types[i] == DT_LNK || types[i] == DT_UNKNOWN) {
+      // Only directories can have the rest of the pattern below them
+      prefix[prefixLen + nameLen] = '/';
+      if (end[1] == '\0') {
+        prefix[prefixLen + nameLen + 1] = '\0';
+        struct stat st;
+        if (stat(prefix, &st) == 0 && S_ISDIR(st.st_mode)) {
+          addGlobResult(a, r, prefix, prefixLen + nameLen + 1);
+        }
+      }
+      else {
+        globFrom(a, r, prefix, prefixLen + nameLen + 1, end + 1);
+      }
+    }
+  }
+  if (owned) {
+    free(names);
+    free(offsets);
+    free(types);
+  }
+}
+
+int compareStrings(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+// Append to p's args, doubling the array when it fills up
+void addArgument(Arena *a, Process *p, int *maxArgs, char *arg) {
+  // Keep room for the ending NULL pointer for execv
+  if (p->nargs + 1 >= *maxArgs) {
+    int newMax = *maxArgs * 2;
+    p->args = arenaRealloc(a, p->args, sizeof(*(p->args)) * p->nargs,
+      sizeof(*(p->args)) * newMax);
+    *maxArgs = newMax;
+  }
+  p->args[p->nargs++] = arg;
+}
+
+/*
+  Expand the word as a glob into p's args. Returns the number of paths
+  added, or 0 if nothing matched and the word should be kept as is.
+*/
+int expandGlob(Arena *a, Process *p, int *maxArgs, const char *word, size_t len) {
+  char pattern[MAX_PATH];
+  if (len >= MAX_PATH) {
+    return 0;
+  }
+  memcpy(pattern, word, len);
+  pattern[len] = '\0';
+
+  uint64_t start = traceStart();
+  GlobResult r = {0};
+  char prefix[MAX_PATH];
+  size_t prefixLen = 0;
+  const char *rest = pattern;
+  if (pattern[0] == '/') {
+    prefix[prefixLen++] = '/';
+    rest++;
+  }
+  globFrom(a, &r, prefix, prefixLen, rest);
+
+  qsort(r.paths, r.count, sizeof(char *), compareStrings);
+  for (int i = 0; i < r.count; i++) {
+    addArgument(a, p, maxArgs, r.paths[i]);
+  }
+  free(r.paths);
+  traceEnd(TRACE_GLOB, start, r.count);
+  STATS.globWords++;
+  STATS.globPaths += r.count;
+  return r.count;
+}
+
+/*
+  Tokenize a line and build its ProcessGroups and Processes in a single
+  pass. Words are copied straight into the arena and the operators
+  drive the same state machine (changeState/saveToken) that decides
+  where each word goes and which sequences are errors.
+*/
+int parseLine(Arena *a, ProcessGroup **pgsPtr, char *line, size_t len){
+  // **pgsPtr is a pointer to an array of ProcessGroups
+
+  if (expandHistory(a, &line, &len) != 0) {
+    logPrint("expandHistory failed\n");
+    return -1;
+  }
+  if (saveCommandToHistory(line, len) < 0) {
+    logPrint("saveCommandToHistory failed\n");
+    return -1;
+  }
+
+  // Directory listings are shared by all the globs on a line
+  GLOB_LINE++;
+
+  ProcessGroup *pgs = NULL;
+  int ngroups = 0;
+  int maxPgs = 0;
+  ProcessGroup *pg = NULL;
+  int maxProcesses = 0;
+  Process *p = NULL;
+  int maxArgs = 0;
+  state currState = ARGUMENT;
+
+  // The last operator seen, or 0 if a word has come since
+  char prevop = 0;
+  bool seenToken = false;
+
+  char *end = line + len;
+  for (char *c = line; c < end; ) {
+    if (*c == ' ' || *c == '\t') {
+      c++;
+      continue;
+    }
+
+    if (*c == '|' || *c == '&' || *c == '<' || *c == '>') {
+      if (!seenToken && *c != '&') {
+        logPrint("Syntax Error: %c found at beginning of line\n", *c);
+        printError();
+        return -1;
+      }
+      if (prevop != 0) {
+        logPrint("Syntax Error: %c found after %c\n", *c, prevop);
+        printError();
+        return -1;
+      }
+      prevop = *c;
+      seenToken = true;
+
+      if (*c == '<' && c + 1 < end && c[1] == '<') {
+        // << reads a here-document, <<< a here-string
+        bool string = c + 2 < end && c[2] == '<';
+        if (changeState(&currState, string ? DELIM_HERESTRING : DELIM_HEREDOC, p) != 0) {
+          return -1;
+        }
+        c += string ? 3 : 2;
+        continue;
+      }
+      else if (*c == '<' || *c == '>') {
+        if (changeState(&currState, *c, p) != 0) {
+          return -1;
+        }
+      }
+      else if (p != NULL) {
+        // End of a process, and for & also the end of its group
+        if (changeState(&currState, 0, p) != 0) {
+          return -1;
+        }
+        p->args[p->nargs] = NULL;
+        p = NULL;
+        if (*c == '&') {
+          pg = NULL;
+        }
+      }
+      c++;
+      continue;
+    }
+
+    char *word = c;
+    while (c < end && isWordChar(*c)) {
+      c++;
+    }
+    prevop = 0;
+    seenToken = true;
+
+    if (p == NULL) {
+      if (pg == NULL) {
+        if (ngroups == maxPgs) {
+          maxPgs = maxPgs == 0 ? 1 : maxPgs * 2;
+          pgs = arenaRealloc(a, pgs, sizeof(*pgs) * ngroups, sizeof(*pgs) * maxPgs);
+        }
+        pg = &pgs[ngroups];
+        initializeProcessGroup(pg, ngroups);
+        ngroups++;
+        maxProcesses = 0;
+      }
+      p = addProcess(a, pg, &maxProcesses);
+      maxArgs = 5;
+      p->args = arenaAlloc(a, sizeof(*(p->args)) * maxArgs);
+      currState = ARGUMENT;
+    }
+
+    // A glob becomes the paths it matches, or stays as it is if none do
+    if (currState == ARGUMENT && hasGlobChars(word, c - word) &&
+        expandGlob(a, p, &maxArgs, word, c - word) > 0) {
+      logPrint("Expanded %.*s to %d args\n", (int)(c - word), word, p->nargs);
+    }
+    else if (saveToken(a, p, word, c - word, currState) != 0) {
+      logPrint("Save token failed\n");
+      return -1;
+    }
+    // Keep room for the ending NULL pointer for execv
+    if (p->nargs + 1 == maxArgs) {
+      maxArgs *= 2;
+      p->args = arenaRealloc(a, p->args, sizeof(*(p->args)) * p->nargs,
+        sizeof(*(p->args)) * maxArgs);
+    }
+  }
+
+  if (prevop == '|' || prevop == '<' || prevop == '>') {
+    logPrint("Invalid token at end of line: %c\n", prevop);
+    printError();
+    return -1;
+  }
+  if (p != NULL) {
+    if (changeState(&currState, 0, p) != 0) {
+      return -1;
+    }
+    p->args[p->nargs] = NULL;
+  }
+
+  // Don't put the last group in the background unless specified
+  if (ngroups > 0 && prevop != '&') {
+    logPrint("number of groups: %d\n", ngroups);
+    pgs[ngroups-1].background = false;
+  }
+
+  *pgsPtr = pgs;
+  return ngroups;
+}
+
+unsigned long hashString(char *s) {
+  // FNV-1a
+  unsigned long h = 14695981039346656037UL;
+  for (; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 1099511628211UL;
+  }
+  return h;
+}
+
+void unloadPathDirs() {
+  for (int i = 0; i < N_PATH_DIRS; i++) {
+    free(PATH_DIRS[i].dir);
+  }
+  free(PATH_DIRS);
+  PATH_DIRS = NULL;
+  N_PATH_DIRS = 0;
+  if (PATH_NOTIFY_FD >= 0) {
+    close(PATH_NOTIFY_FD);
+    PATH_NOTIFY_FD = -1;
+  }
+  PATH_DIRS_LOADED = false;
+}
+
+// Note a new mtime for d, which is none at all while d doesn't exist.
+// Returns whether it exists.
+bool checkPathDir(PathDir *d) {
+  struct stat st;
+  struct timespec mtime = {0, 0};
+  bool exists = stat(d->dir, &st) == 0;
+  if (exists) {
+    mtime = st.st_mtim;
+  }
+  if (mtime.tv_sec != d->mtime.tv_sec || mtime.tv_nsec != d->mtime.tv_nsec) {
+    d->mtime = mtime;
+    d->changed = ++PATH_EPOCH;
+  }
+  return exists;
+}
+
+void watchPathDir(PathDir *d) {
+  d->wd = inotify_add_watch(PATH_NOTIFY_FD, d->dir,
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+  logPrint("Watching %s (wd=%d)\n", d->dir, d->wd);
+}
+
+void loadPathDirs() {
+  unloadPathDirs();
+
+  // Watch every directory on the path so that changes to them can be
+  // noticed with a single non-blocking read instead of a stat per dir
+  PATH_NOTIFY_FD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (PATH_NOTIFY_FD < 0) {
+    logPrint("inotify unavailable, falling back to directory mtimes\n");
+  }
+
+  char *searchpathcpy = strdup(SEARCH_PATH);
+  char *token = strtok(searchpathcpy, ";");
+  int maxDirs = 4;
+  PATH_DIRS = malloc(sizeof(*PATH_DIRS) * maxDirs);
+
+  while (token != NULL) {
+    if (N_PATH_DIRS == maxDirs) {
+      maxDirs *= 2;
+      PATH_DIRS = realloc(PATH_DIRS, sizeof(*PATH_DIRS) * maxDirs);
+    }
+    PathDir *d = &PATH_DIRS[N_PATH_DIRS++];
+    d->dir = strdup(token);
+    d->wd = -1;
+    d->changed = PATH_EPOCH;
+    memset(&d->mtime, 0, sizeof(d->mtime));
+
+    struct stat st;
+    if (stat(d->dir, &st) == 0) {
+      d->mtime = st.st_mtim;
+    }
+    if (PATH_NOTIFY_FD >= 0) {
+      watchPathDir(d);
+    }
+    token = strtok(NULL, ";");
+  }
+
+  free(searchpathcpy);
+  PATH_DIRS_LOADED = true;
+}
+
+/*
+  Take watches of our own in a forked copy of the shell, whose inotify
+  instance is still shared with its parent and siblings: whichever of
+  them read an event first would keep it from the rest. Anything that
+  changed since the directories were loaded shows in their mtimes.
+*/
+void reloadPathDirs() {
+  if (!PATH_DIRS_LOADED) {
+    return;
+  }
+  int n = N_PATH_DIRS;
+  struct timespec *loaded = malloc(sizeof(*loaded) * (n + 1));
+  for (int i = 0; i < n; i++) {
+    loaded[i] = PATH_DIRS[i].mtime;
+  }
+  loadPathDirs();
+  for (int i = 0; i < n && i < N_PATH_DIRS; i++) {
+    if (loaded[i].tv_sec != PATH_DIRS[i].mtime.tv_sec ||
+        loaded[i].tv_nsec != PATH_DIRS[i].mtime.tv_nsec) {
+      PATH_DIRS[i].changed = ++PATH_EPOCH;
+    }
+  }
+  free(loaded);
+}
+
+void markPathDirChanged(int wd) {
+  PATH_EPOCH++;
+  for (int i = 0; i < N_PATH_DIRS; i++) {
+    if (wd < 0 || PATH_DIRS[i].wd == wd) {
+      logPrint("Path directory changed: %s\n", PATH_DIRS[i].dir);
+      PATH_DIRS[i].changed = PATH_EPOCH;
+    }
+  }
+}
+
+void refreshPathDirs() {
+  if (!PATH_DIRS_LOADED) {
+    loadPathDirs();
+    return;
+  }
+
+  if (PATH_NOTIFY_FD < 0) {
+    for (int i = 0; i < N_PATH_DIRS; i++) {
+      checkPathDir(&PATH_DIRS[i]);
+    }
+    return;
+  }
+
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  while ((n = read(PATH_NOTIFY_FD, buf, sizeof(buf))) > 0) {
+    for (char *ptr = buf; ptr < buf + n; ) {
+      struct inotify_event *ev = (struct inotify_event *)ptr;
+      // An overflowed queue means we lost track, so treat everything as changed
+      markPathDirChanged(ev->mask & IN_Q_OVERFLOW ? -1 : ev->wd);
+      // A directory that went away or moved is no longer watched; a
+      // moved one's watch follows it, so drop that
+      for (int i = 0; i < N_PATH_DIRS && ev->wd >= 0; i++) {
+        PathDir *d = &PATH_DIRS[i];
+        if (d->wd == ev->wd && ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+          if (ev->mask & IN_MOVE_SELF) {
+            inotify_rm_watch(PATH_NOTIFY_FD, d->wd);
+          }
+          d->wd = -1;
+        }
+      }
+      ptr += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+
+  // Unwatched directories are checked the slow way until they can be
+  // watched again. Anything created before the watch took is only
+  // seen by marking the directory changed once more.
+  for (int i = 0; i < N_PATH_DIRS; i++) {
+    PathDir *d = &PATH_DIRS[i];
+    if (d->wd < 0 && checkPathDir(d)) {
+      watchPathDir(d);
+      if (d->wd >= 0) {
+        d->changed = ++PATH_EPOCH;
+      }
+    }
+  }
+}
+
+bool hashEntryValid(HashEntry *e) {
+  // A hit only depends on the directories up to the one it was found
+  // in, while a miss depends on all of them
+  int last = e->dir >= 0 ? e->dir : N_PATH_DIRS - 1;
+  for (int i = 0; i <= last; i++) {
+    if (PATH_DIRS[i].changed > e->epoch) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void resolveCommand(HashEntry *e) {
+  char dest[MAX_PATH];
+  free(e->path);
+  e->path = NULL;
+  e->dir = -1;
+  e->epoch = PATH_EPOCH;
+
+  for (int i = 0; i < N_PATH_DIRS; i++) {
+    snprintf(dest, MAX_PATH, "%s/%s", PATH_DIRS[i].dir, e->name);
+    if (access(dest, X_OK) == 0) {
+      e->path = strdup(dest);
+      e->dir = i;
+      break;
+    }
+  }
+  logPrint("Resolved %s to %s\n", e->name, e->path ? e->path : "(not found)");
+}
+
+HashEntry *findHashSlot(HashEntry *table, int size, char *name) {
+  int i = hashString(name) & (size - 1);
+  while (table[i].name != NULL && strcmp(table[i].name, name) != 0) {
+    i = (i + 1) & (size - 1);
+  }
+  return &table[i];
+}
+
+void growCommandHash() {
+  int newSize = CMD_HASH_SIZE == 0 ? 64 : CMD_HASH_SIZE * 2;
+  HashEntry *newTable = calloc(newSize, sizeof(*newTable));
+  for (int i = 0; i < CMD_HASH_SIZE; i++) {
+    if (CMD_HASH[i].name != NULL) {
+      *findHashSlot(newTable, newSize, CMD_HASH[i].name) = CMD_HASH[i];
+    }
+  }
+  free(CMD_HASH);
+  CMD_HASH = newTable;
+  CMD_HASH_SIZE = newSize;
+  logPrint("Grew command hash to %d slots\n", newSize);
+}
+
+void flushCommandHash() {
+  for (int i = 0; i < CMD_HASH_SIZE; i++) {
+    free(CMD_HASH[i].name);
+    free(CMD_HASH[i].path);
+  }
+  memset(CMD_HASH, 0, sizeof(*CMD_HASH) * CMD_HASH_SIZE);
+  CMD_HASH_COUNT = 0;
+  unloadPathDirs();
+}
+
+HashEntry *prefetchCommand(char *name) {
+  refreshPathDirs();
+
+  if ((CMD_HASH_COUNT + 1) * 2 > CMD_HASH_SIZE) {
+    growCommandHash();
+  }
+
+  HashEntry *e = findHashSlot(CMD_HASH, CMD_HASH_SIZE, name);
+  if (e->name == NULL) {
+    e->name = strdup(name);
+    CMD_HASH_COUNT++;
+    resolveCommand(e);
+  }
+  else if (!hashEntryValid(e)) {
+    logPrint("Stale hash entry for %s\n", name);
+    resolveCommand(e);
+    e->hits = 0;
+  }
+  return e;
+}
+
+HashEntry *lookupCommand(char *name) {
+  uint64_t start = traceStart();
+  HashEntry *e = prefetchCommand(name);
+  if (e->path != NULL) {
+    e->hits++;
+  }
+  traceEnd(TRACE_LOOKUP, start, e->path != NULL);
+  return e;
+}
+
+int hash(int nargs, char **args, int in, int out) {
+  if (nargs == 2 && strcmp(args[1], "-r") == 0) {
+    flushCommandHash();
+    return 0;
+  }
+
+  // Remember the given commands without running them
+  if (nargs > 1) {
+    int rc = 0;
+    for (int i = 1; i < nargs; i++) {
+      if (args[i][0] == '-' || lookupCommand(args[i])->path == NULL) {
+        printError();
+        rc = -1;
+      }
+    }
+    return rc;
+  }
+
+  bool empty = true;
+  for (int i = 0; i < CMD_HASH_SIZE; i++) {
+    HashEntry *e = &CMD_HASH[i];
+    if (e->name == NULL || e->path == NULL) {
+      continue;
+    }
+    if (empty) {
+      dprintf(out, "hits\tcommand\n");
+      empty = false;
+    }
+    dprintf(out, "%4d\t%s\n", e->hits, e->path);
+  }
+  if (empty) {
+    dprintf(out, "hash table empty\n");
+  }
+  return 0;
+}
+
+int path(int nargs, char **args, int in, int out) {
+  // TODO: might need to check if path given exists?
+  if (nargs == 1){
+    memset(SEARCH_PATH, 0, sizeof(char) * strlen(SEARCH_PATH));
+  }
+  else {
+    size_t allocSize = MAX_PATH;
+    char* buf = (char *)malloc(allocSize);
+    char* fullPath = getcwd(buf, allocSize);
+    strcat(fullPath, "/");
+    for (int i = 1; i < nargs; i++){
+      char c = args[i][0];
+      strcat(SEARCH_PATH, ";");
+      if (c != '/' && c != '~' && !(c=='.'&&args[i][1]=='/')){
+        strcat(SEARCH_PATH, fullPath);
+      }
+      strcat(SEARCH_PATH, args[i]);
+    }
+    logPrint("New SEARCH_PATH: %s\n", SEARCH_PATH);
+    free(buf);
+  }
+  flushCommandHash();
+  return 0;
+}
+
+int cd(int nargs, char **args, int in, int out) {
+  if (nargs != 2) {
+    logPrint("Wrong number of args for cd (given %d)\n", nargs);
+    printError();
+    return -1;
+  }
+  size_t allocSize = sizeof(char) * 1024;
+  char* buf = (char *)malloc(allocSize);
+  char* path = getcwd(buf, allocSize);
+  strcat(path, "/");
+  strcat(path, args[1]);
+  if (access(path, F_OK) == 0) {
+    chdir(path);
+  }
+  else {
+    logPrint("Path for cd is not accessible: %s\n", path);
+    free(buf);
+    return -1;
+  }
+  free(buf);
+  return 0;
+}
+
+/*
+  Regular files are mapped whole and lines are handed out as pointers
+  into the mapping. Anything else (pipes, terminals) is read in large
+  chunks into a buffer that grows to fit the longest line.
+*/
+void openInput(Input *in, int fd) {
+  memset(in, 0, sizeof(*in));
+  in->fd = fd;
+
+  // Reading starts wherever the fd's offset already is
+  struct stat st;
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > offset) {
+    in->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (in->map != MAP_FAILED) {
+      in->size = st.st_size;
+      in->pos = offset > 0 ? offset : 0;
+      madvise(in->map, in->size, MADV_SEQUENTIAL);
+      logPrint("Mapped %zu bytes of input\n", in->size);
+      return;
+    }
+    in->map = NULL;
+  }
+  else if (S_ISREG(st.st_mode)) {
+    in->eof = true;
+    return;
+  }
+
+  in->cap = INPUT_CHUNK_SIZE;
+  in->buf = malloc(in->cap);
+}
+
+void closeInput(Input *in) {
+  if (in->map != NULL) {
+    munmap(in->map, in->size);
+  }
+  free(in->buf);
+  in->map = NULL;
+  in->buf = NULL;
+}
+
+/*
+  Read another chunk into the buffer behind what is left of the current
+  line, growing it when the line is already most of the buffer
+*/
+void fillInput(Input *in) {
+  memmove(in->buf, in->buf + in->start, in->end - in->start);
+  in->end -= in->start;
+  in->start = 0;
+  if (in->cap - in->end < INPUT_CHUNK_SIZE / 2) {
+    in->cap *= 2;
+    in->buf = realloc(in->buf, in->cap);
+  }
+
+  while (1) {
+    ssize_t n = read(in->fd, in->buf + in->end, in->cap - in->end);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      in->eof = true;
+    }
+    else {
+      in->end += n;
+    }
+    return;
+  }
+}
+
+int readLine(Input *in, char **line, size_t *len) {
+  if (in->map != NULL) {
+    if (in->pos >= in->size) {
+      return -1;
+    }
+    char *start = in->map + in->pos;
+    char *nl = memchr(start, '\n', in->size - in->pos);
+    *line = start;
+    *len = (nl == NULL ? in->map + in->size : nl) - start;
+    in->pos += *len + 1;
+    in->lines++;
+    return 0;
+  }
+
+  while (1) {
+    char *start = in->buf + in->start;
+    char *nl = memchr(start, '\n', in->end - in->start);
+    if (nl != NULL || (in->eof && in->start < in->end)) {
+      *line = start;
+      *len = (nl == NULL ? in->buf + in->end : nl) - start;
+      in->start += *len + (nl != NULL);
+      in->lines++;
+      return 0;
+    }
+    if (in->eof) {
+      return -1;
+    }
+    fillInput(in);
+  }
+}
+
+/*
+  Like readLine() but hands out as many whole lines as are available
+  at once, newlines included. Only the last chunk before EOF may end
+  without one. A mapped file comes back in a single chunk.
+*/
+int readChunk(Input *in, char **data, size_t *len) {
+  if (in->map != NULL) {
+    if (in->pos >= in->size) {
+      return -1;
+    }
+    *data = in->map + in->pos;
+    *len = in->size - in->pos;
+    in->pos = in->size;
+    return 0;
+  }
+
+  while (1) {
+    char *start = in->buf + in->start;
+    size_t avail = in->end - in->start;
+    char *nl = avail > 0 ? memrchr(start, '\n', avail) : NULL;
+    if (nl != NULL || (in->eof && avail > 0)) {
+      *data = start;
+      *len = (nl == NULL ? in->buf + in->end : nl + 1) - start;
+      in->start += *len;
+      return 0;
+    }
+    if (in->eof) {
+      return -1;
+    }
+    fillInput(in);
+  }
+}
+
+__thread char *COPY_BUFFER = NULL;
+
+bool canFallBack(int err) {
+  return err == EINVAL || err == ENOSYS || err == EXDEV ||
+    err == EOPNOTSUPP || err == EBADF;
+}
+
+/*
+  Copy everything from in to out using the cheapest mechanism the
+  kernel offers for that pair of file types. Each method moves the
+  file offsets along with it, so when one is refused part way through
+  the next one picks up where it left off.
+*/
+ssize_t copyFd(int in, int out) {
+  struct stat inSt, outSt;
+  if (fstat(in, &inSt) < 0 || fstat(out, &outSt) < 0) {
+    return -1;
+  }
+  ssize_t total = 0;
+  ssize_t n = -1;
+
+  if (S_ISFIFO(inSt.st_mode) || S_ISFIFO(outSt.st_mode)) {
+    while ((n = splice(in, NULL, out, NULL, CAT_CHUNK_SIZE, SPLICE_F_MOVE)) > 0) {
+      total += n;
+    }
+    if (n == 0) {
+      __atomic_fetch_add(&STATS.catSplice, 1, __ATOMIC_RELAXED);
+      return total;
+    }
+    else if (!canFallBack(errno)) {
+      return -1;
+    }
+  }
+
+  if (S_ISREG(inSt.st_mode) && S_ISREG(outSt.st_mode)) {
+    while ((n = copy_file_range(in, NULL, out, NULL, CAT_CHUNK_SIZE, 0)) > 0) {
+      total += n;
+    }
+    if (n == 0) {
+      __atomic_fetch_add(&STATS.catCopyFileRange, 1, __ATOMIC_RELAXED);
+      return total;
+    }
+    else if (!canFallBack(errno)) {
+      return -1;
+    }
+  }
+
+  if (S_ISREG(inSt.st_mode)) {
+    while ((n = sendfile(out, in, NULL, CAT_CHUNK_SIZE)) > 0) {
+      total += n;
+    }
+    if (n == 0) {
+      __atomic_fetch_add(&STATS.catSendfile, 1, __ATOMIC_RELAXED);
+      return total;
+    }
+    else if (!canFallBack(errno)) {
+      return -1;
+    }
+  }
+
+  // Plain read/write through one large page-aligned buffer, one per
+  // thread since cat can run on several at once
+  char *buf = COPY_BUFFER;
+  if (buf == NULL) {
+    if (posix_memalign((void **)&buf, 4096, CAT_BUFFER_SIZE) != 0) {
+      return -1;
+    }
+    COPY_BUFFER = buf;
+  }
+  while ((n = read(in, buf, CAT_BUFFER_SIZE)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    for (ssize_t written = 0; written < n; ) {
+      ssize_t w = write(out, buf + written, n - written);
+      if (w < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return -1;
+      }
+      written += w;
+    }
+    total += n;
+  }
+  __atomic_fetch_add(&STATS.catReadWrite, 1, __ATOMIC_RELAXED);
+  return total;
+}
+
+int cat(int nargs, char **args, int in, int out) {
+  if (nargs == 1) {
+    ssize_t n = copyFd(in, out);
+    if (n < 0) {
+      logPrint("Copying stdin failed: %s\n", strerror(errno));
+      // A reader that stopped early isn't an error, as with SIGPIPE
+      if (errno != EPIPE) {
+        printError();
+      }
+      return -1;
+    }
+    __atomic_fetch_add(&STATS.catBytes, n, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  // Iterate over each file in command
+  // Start at 1 since the first arg is the name of the program
+  for (int i = 1; i < nargs; i++){
+    int fd = open(args[i], O_RDONLY | O_CLOEXEC);
+
+    // If fd is negative, the file does not exist
+    if (fd < 0){
+      printError();
+      return -1;
+    }
+
+    ssize_t n = copyFd(fd, out);
+    close(fd);
+    if (n < 0) {
+      logPrint("Copying %s failed: %s\n", args[i], strerror(errno));
+      if (errno != EPIPE) {
+        printError();
+      }
+      return -1;
+    }
+    __atomic_fetch_add(&STATS.catBytes, n, __ATOMIC_RELAXED);
+  }
+
+  return 0;
+}
+
+/*
+  Byte counting and substring search for the text builtins. Each has a
+  portable version plus SSE2 and AVX2 ones on x86-64, and the best one
+  the CPU supports is picked the first time it is needed.
+*/
+size_t countByteScalar(const char *s, size_t n, char c) {
+  size_t count = 0;
+  for (const char *end = s + n; (s = memchr(s, c, end - s)) != NULL; s++) {
+    count++;
+  }
+  return count;
+}
+
+const char *findBytesScalar(const char *s, size_t n, const char *needle, size_t m) {
+  return memmem(s, n, needle, m);
+}
+
+#if defined(__x86_64__)
+/*
+  Matches are subtracted into per-byte counters (a match is -1), which
+  are summed with psadbw before any of them can overflow
+*/
+size_t countByteSse2(const char *s, size_t n, char c) {
+  __m128i needle = _mm_set1_epi8(c);
+  size_t count = 0;
+  size_t i = 0;
+  while (i + 16 <= n) {
+    __m128i acc = _mm_setzero_si128();
+    for (int k = 0; k < 255 && i + 16 <= n; k++, i += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i *)(s + i));
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(block, needle));
+    }
+    __m128i sums = _mm_sad_epu8(acc, _mm_setzero_si128());
+    count += _mm_cvtsi128_si64(sums) + _mm_extract_epi16(sums, 4);
+  }
+  return count + countByteScalar(s + i, n - i, c);
+}
+
+__attribute__((target("avx2")))
+size_t countByteAvx2(const char *s, size_t n, char c) {
+  __m256i needle = _mm256_set1_epi8(c);
+  size_t count = 0;
+  size_t i = 0;
+  while (i + 32 <= n) {
+    __m256i acc = _mm256_setzero_si256();
+    for (int k = 0; k < 255 && i + 32 <= n; k++, i += 32) {
+      __m256i block = _mm256_loadu_si256((const __m256i *)(s + i));
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(block, needle));
+    }
+    __m256i sums = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+    count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+      _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+  }
+  return count + countByteScalar(s + i, n - i, c);
+}
+
+/*
+  Compare the needle's first and last bytes against a block of
+  candidate positions at once and only memcmp where both match
+*/
+const char *findBytesSse2(const char *s, size_t n, const char *needle, size_t m) {
+  if (m < 2 || n < m) {
+    return memmem(s, n, needle, m);
+  }
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i last = _mm_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+      _mm_cmpeq_epi8(b, last)));
+    for (; mask != 0; mask &= mask - 1) {
+      size_t at = i + __builtin_ctz(mask);
+      if (memcmp(s + at + 1, needle + 1, m - 2) == 0) {
+        return s + at;
+      }
+    }
+  }
+  return memmem(s + i, n - i, needle, m);
+}
+
+__attribute__((target("avx2")))
+const char *findBytesAvx2(const char *s, size_t n, const char *needle, size_t m) {
+  if (m < 2 || n < m) {
+    return memmem(s, n, needle, m);
+  }
+  __m256i first = _mm256_set1_epi8(needle[0]);
+  __m256i last = _mm256_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + i + m - 1));
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+      _mm256_cmpeq_epi8(b, last)));
+    for (; mask != 0; mask &= mask - 1) {
+      size_t at = i + __builtin_ctz(mask);
+      if (memcmp(s + at + 1, needle + 1, m - 2) == 0) {
+        return s + at;
+      }
+    }
+  }
+  return memmem(s + i, n - i, needle, m);
+}
+#endif
+
+// Chosen once by main() before any builtin thread can start, so the
+// threads only ever read these
+size_t (*COUNT_BYTE)(const char *s, size_t n, char c) = countByteScalar;
+const char *(*FIND_BYTES)(const char *s, size_t n, const char *needle, size_t m) = findBytesScalar;
+char *TEXT_SIMD = "scalar";
+
+void pickTextRoutines() {
+#if defined(__x86_64__)
+  COUNT_BYTE = countByteSse2;
+  FIND_BYTES = findBytesSse2;
+  TEXT_SIMD = "sse2";
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    COUNT_BYTE = countByteAvx2;
+    FIND_BYTES = findBytesAvx2;
+    TEXT_SIMD = "avx2";
+  }
+#endif
+  logPrint("Text builtins use %s\n", TEXT_SIMD);
+}
+
+size_t countByte(const char *s, size_t n, char c) {
+  return COUNT_BYTE(s, n, c);
+}
+
+const char *findBytes(const char *s, size_t n, const char *needle, size_t m) {
+  return FIND_BYTES(s, n, needle, m);
+}
+
+/*
+  wc, head, tail and grep -F only take the options below. Anything
+  else makes findBuiltIn() pass, so the command on the path runs
+  instead with all of its behaviour.
+*/
+typedef struct {
+  bool lines;
+  bool bytes;
+  bool invert;
+  bool count;
+  long n;
+  char *pattern;
+  int files;
+} TextOptions;
+
+// -n N or -N for head and tail, which take at most one file
+bool lineCountOptions(int nargs, char **args, TextOptions *o) {
+  o->n = 10;
+  int i = 1;
+  for (; i < nargs && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    char *digits = args[i] + 1;
+    if (strcmp(args[i], "-n") == 0 && i + 1 < nargs) {
+      digits = args[++i];
+    }
+    char *end;
+    errno = 0;
+    o->n = strtol(digits, &end, 10);
+    if (!isdigit((unsigned char)*digits) || *end != '\0' || errno != 0) {
+      return false;
+    }
+  }
+  o->files = i;
+  return nargs - i <= 1;
+}
+
+bool wcOptions(int nargs, char **args, TextOptions *o) {
+  int i = 1;
+  for (; i < nargs && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    for (char *c = args[i] + 1; *c; c++) {
+      if (*c == 'l') {
+        o->lines = true;
+      }
+      else if (*c == 'c') {
+        o->bytes = true;
+      }
+      else {
+        return false;
+      }
+    }
+  }
+  o->files = i;
+  // Plain wc also counts words, which depend on the locale
+  return o->lines || o->bytes;
+}
+
+bool grepOptions(int nargs, char **args, TextOptions *o) {
+  bool fixed = false;
+  int i = 1;
+  for (; i < nargs && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    for (char *c = args[i] + 1; *c; c++) {
+      if (*c == 'F') {
+        fixed = true;
+      }
+      else if (*c == 'v') {
+        o->invert = true;
+      }
+      else if (*c == 'c') {
+        o->count = true;
+      }
+      else {
+        return false;
+      }
+    }
+  }
+  if (!fixed || i >= nargs) {
+    return false;
+  }
+  o->pattern = args[i];
+  o->files = i + 1;
+  return nargs - o->files <= 1;
+}
+
+bool wcAccepts(int nargs, char **args) {
+  TextOptions o = {0};
+  return wcOptions(nargs, args, &o);
+}
+
+bool lineCountAccepts(int nargs, char **args) {
+  TextOptions o = {0};
+  return lineCountOptions(nargs, args, &o);
+}
+
+bool grepAccepts(int nargs, char **args) {
+  TextOptions o = {0};
+  return grepOptions(nargs, args, &o);
+}
+
+// Output gathered into large writes, since grep may emit many short lines
+typedef struct {
+  int fd;
+  char *buf;
+  size_t used;
+  bool failed;
+} TextOutput;
+
+void flushText(TextOutput *o) {
+  for (size_t done = 0; done < o->used && !o->failed; ) {
+    ssize_t n = write(o->fd, o->buf + done, o->used - done);
+    if (n < 0 && errno != EINTR) {
+      o->failed = true;
+    }
+    done += n > 0 ? n : 0;
+  }
+  o->used = 0;
+}
+
+void emitBytes(TextOutput *o, const char *s, size_t len) {
+  if (o->used + len > CAT_BUFFER_SIZE) {
+    flushText(o);
+  }
+  if (len < CAT_BUFFER_SIZE) {
+    memcpy(o->buf + o->used, s, len);
+    o->used += len;
+    return;
+  }
+  for (size_t done = 0; done < len && !o->failed; ) {
+    ssize_t n = write(o->fd, s + done, len - done);
+    if (n < 0 && errno != EINTR) {
+      o->failed = true;
+    }
+    done += n > 0 ? n : 0;
+  }
+}
+
+// Write whole lines, supplying the newline a last line may be missing
+void emitLines(TextOutput *o, const char *s, size_t len) {
+  if (len > 0 && !o->failed) {
+    emitBytes(o, s, len);
+    if (s[len - 1] != '\n') {
+      emitBytes(o, "\n", 1);
+    }
+  }
+}
+
+size_t countLines(const char *s, size_t len) {
+  return len == 0 ? 0 : countByte(s, len, '\n') + (s[len - 1] != '\n');
+}
+
+/*
+  Open the one file a text builtin was given, or use in when there is
+  none. Returns the fd to read, or -1 once the error has been printed.
+*/
+int openTextInput(int nargs, char **args, TextOptions *o, int in) {
+  if (o->files >= nargs) {
+    return in;
+  }
+  int fd = open(args[o->files], O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    printError();
+  }
+  return fd;
+}
+
+int finishText(TextOutput *o, int fd, int in, Input *input) {
+  flushText(o);
+  closeInput(input);
+  free(o->buf);
+  if (fd != in) {
+    close(fd);
+  }
+  if (o->failed) {
+    logPrint("Writing output failed: %s\n", strerror(errno));
+    // A reader that stopped early isn't an error, as with SIGPIPE
+    if (errno != EPIPE) {
+      printError();
+    }
+    return -1;
+  }
+  return 0;
+}
+
+int wc(int nargs, char **args, int in, int out) {
+  TextOptions o = {0};
+  wcOptions(nargs, args, &o);
+  int nfiles = nargs - o.files > 0 ? nargs - o.files : 1;
+
+  // Column width as GNU wc picks it: enough for the total size of the
+  // regular files, at least 7 for anything else, 1 for a lone count
+  int width = 1;
+  if (nfiles > 1 || (o.lines && o.bytes)) {
+    unsigned long long total = 0;
+    int minimum = 1;
+    for (int i = 0; i < nfiles; i++) {
+      struct stat st;
+      int ok = o.files < nargs ? stat(args[o.files + i], &st) : fstat(in, &st);
+      if (ok == 0 && S_ISREG(st.st_mode)) {
+        total += st.st_size;
+      }
+      else if (ok == 0) {
+        minimum = 7;
+      }
+    }
+    for (; total >= 10; total /= 10) {
+      width++;
+    }
+    width = width < minimum ? minimum : width;
+  }
+
+  int rc = 0;
+  unsigned long long totalLines = 0, totalBytes = 0;
+  for (int i = 0; i < nfiles + (nfiles > 1); i++) {
+    unsigned long long lines = totalLines, bytes = totalBytes;
+    char *name = i < nfiles ? (o.files < nargs ? args[o.files + i] : NULL) : "total";
+    if (i < nfiles) {
+      int fd = o.files < nargs ? open(name, O_RDONLY | O_CLOEXEC) : in;
+      if (fd < 0) {
+        printError();
+        rc = -1;
+        continue;
+      }
+      Input input;
+      openInput(&input, fd);
+      lines = bytes = 0;
+      if (input.map != NULL && !o.lines) {
+        bytes = input.size - input.pos;
+      }
+      else {
+        char *data;
+        size_t len;
+        while (readChunk(&input, &data, &len) == 0) {
+          lines += countByte(data, len, '\n');
+          bytes += len;
+        }
+      }
+      closeInput(&input);
+      if (fd != in) {
+        close(fd);
+      }
+      __atomic_fetch_add(&STATS.textBytes, bytes, __ATOMIC_RELAXED);
+      totalLines += lines;
+      totalBytes += bytes;
+    }
+
+    char line[128];
+    int used = 0;
+    if (o.lines) {
+      used += snprintf(line + used, sizeof(line) - used, "%*llu", width, lines);
+    }
+    if (o.bytes) {
+      used += snprintf(line + used, sizeof(line) - used, "%s%*llu", used ? " " : "", width, bytes);
+    }
+    if (name != NULL) {
+      dprintf(out, "%s %s\n", line, name);
+    }
+    else {
+      dprintf(out, "%s\n", line);
+    }
+  }
+  return rc;
+}
+
+int head(int nargs, char **args, int in, int out) {
+  TextOptions o = {0};
+  lineCountOptions(nargs, args, &o);
+  int fd = openTextInput(nargs, args, &o, in);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // Stop at the n-th newline without reading any further, so that
+  // whoever is writing into a pipe finds out as soon as possible
+  Input input;
+  openInput(&input, fd);
+  TextOutput output = {out, malloc(CAT_BUFFER_SIZE), 0, false};
+  long left = o.n;
+  char *data;
+  size_t len;
+  while (left > 0 && !output.failed && readChunk(&input, &data, &len) == 0) {
+    size_t take = len;
+    if (countByte(data, len, '\n') >= (size_t)left) {
+      char *c = data;
+      for (; left > 0; left--) {
+        c = memchr(c, '\n', data + len - c) + 1;
+      }
+      take = c - data;
+    }
+    __atomic_fetch_add(&STATS.textBytes, take, __ATOMIC_RELAXED);
+    emitBytes(&output, data, take);
+  }
+  return finishText(&output, fd, in, &input);
+}
+
+// Offset of the first of the last n lines of s
+size_t tailStart(const char *s, size_t len, long n) {
+  if (n == 0) {
+    return len;
+  }
+  const char *c = s + len;
+  if (len > 0 && c[-1] == '\n') {
+    c--;
+  }
+  for (; n > 0; n--) {
+    const char *nl = memrchr(s, '\n', c - s);
+    if (nl == NULL) {
+      return 0;
+    }
+    c = nl;
+  }
+  return c + 1 - s;
+}
+
+int tail(int nargs, char **args, int in, int out) {
+  TextOptions o = {0};
+  lineCountOptions(nargs, args, &o);
+  int fd = openTextInput(nargs, args, &o, in);
+  if (fd < 0) {
+    return -1;
+  }
+
+  Input input;
+  openInput(&input, fd);
+  TextOutput output = {out, malloc(CAT_BUFFER_SIZE), 0, false};
+  char *data;
+  size_t len;
+  if (input.map != NULL) {
+    // A mapped file is searched backwards from its end
+    data = input.map + input.pos;
+    len = input.size - input.pos;
+    size_t start = tailStart(data, len, o.n);
+    __atomic_fetch_add(&STATS.textBytes, len - start, __ATOMIC_RELAXED);
+    emitBytes(&output, data + start, len - start);
+    return finishText(&output, fd, in, &input);
+  }
+
+  // Otherwise keep a window that is trimmed to the last n lines
+  // whenever it has grown past a few chunks
+  char *keep = NULL;
+  size_t kept = 0, cap = 0;
+  while (readChunk(&input, &data, &len) == 0) {
+    __atomic_fetch_add(&STATS.textBytes, len, __ATOMIC_RELAXED);
+    if (kept + len > cap) {
+      cap = (kept + len) * 2;
+      keep = realloc(keep, cap);
+    }
+    memcpy(keep + kept, data, len);
+    kept += len;
+    if (kept > 4 * INPUT_CHUNK_SIZE) {
+      size_t start = tailStart(keep, kept, o.n);
+      memmove(keep, keep + start, kept - start);
+      kept -= start;
+    }
+  }
+  size_t start = tailStart(keep, kept, o.n);
+  emitBytes(&output, keep + start, kept - start);
+  free(keep);
+  return finishText(&output, fd, in, &input);
+}
+
+int grep(int nargs, char **args, int in, int out) {
+  TextOptions o = {0};
+  grepOptions(nargs, args, &o);
+  int fd = openTextInput(nargs, args, &o, in);
+  if (fd < 0) {
+    return -1;
+  }
+
+  Input input;
+  openInput(&input, fd);
+  TextOutput output = {out, malloc(CAT_BUFFER_SIZE), 0, false};
+  size_t plen = strlen(o.pattern);
+  unsigned long long selected = 0;
+  char *data;
+  size_t len;
+  while (!output.failed && readChunk(&input, &data, &len) == 0) {
+    __atomic_fetch_add(&STATS.textBytes, len, __ATOMIC_RELAXED);
+    // Jump from match to match; with -v the lines in between are the
+    // output, and they go out in one piece
+    char *end = data + len;
+    for (char *c = data; c < end; ) {
+      char *match = (char *)findBytes(c, end - c, o.pattern, plen);
+      if (match == NULL) {
+        if (o.invert) {
+          selected += countLines(c, end - c);
+          if (!o.count) {
+            emitLines(&output, c, end - c);
+          }
+        }
+        break;
+      }
+      char *lineStart = memrchr(c, '\n', match - c);
+      lineStart = lineStart == NULL ? c : lineStart + 1;
+      char *lineEnd = memchr(match, '\n', end - match);
+      lineEnd = lineEnd == NULL ? end : lineEnd + 1;
+      if (o.invert) {
+        selected += countLines(c, lineStart - c);
+        if (!o.count) {
+          emitLines(&output, c, lineStart - c);
+        }
+      }
+      else {
+        selected++;
+        if (!o.count) {
+          emitLines(&output, lineStart, lineEnd - lineStart);
+        }
+      }
+      c = lineEnd;
+    }
+  }
+  if (o.count) {
+    char count[32];
+    emitLines(&output, count, snprintf(count, sizeof(count), "%llu\n", selected));
+  }
+  // Like grep, succeed only if some line was selected
+  int rc = finishText(&output, fd, in, &input);
+  return rc == 0 && selected == 0 ? -1 : rc;
+}
+
+/*
+  Placement of the processes a line starts. The stages of a group
+  always go on adjacent CPUs of one NUMA node, so pipe data stays in
+  caches they share. With pin pack, successive groups fill up one node
+  before moving to the next; with pin spread, they take turns between
+  nodes, so concurrent groups land as far apart as they can.
+  Background groups can also be niced and run under SCHED_BATCH. All
+  of it is applied in the child before it execs, so a line with
+  anything to apply is forked rather than spawned.
+*/
+typedef enum {
+  PIN_OFF,
+  PIN_PACK,
+  PIN_SPREAD,
+} PinMode;
+
+char *PIN_NAMES[] = {"off", "pack", "spread"};
+
+typedef struct {
+  PinMode mode;
+  int nice;
+  bool batch;
+  // The CPUs we may use, node by node, and the node of each
+  int ncpus;
+  int *cpus;
+  int *nodes;
+  // Where each node's CPUs start in cpus, and how many it has
+  int nnodes;
+  int *nodeStart;
+  int *nodeSize;
+  // Next CPU for pack, and next node and CPU within each for spread
+  int next;
+  int nextNode;
+  int *nodeNext;
+} Placement;
+
+Placement PLACEMENT;
+
+// Add the CPUs in a /sys cpulist ("0-3,8,10-11") that we may run on
+void addCpuList(char *list, int node, cpu_set_t *allowed) {
+  for (char *range = strtok(list, ",\n"); range != NULL; range = strtok(NULL, ",\n")) {
+    int first, last;
+    int n = sscanf(range, "%d-%d", &first, &last);
+    if (n < 1) {
+      continue;
+    }
+    for (int cpu = first; cpu <= (n == 2 ? last : first); cpu++) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, allowed)) {
+        PLACEMENT.cpus[PLACEMENT.ncpus] = cpu;
+        PLACEMENT.nodes[PLACEMENT.ncpus++] = node;
+        CPU_CLR(cpu, allowed);
+      }
+    }
+  }
+}
+
+void loadTopology() {
+  if (PLACEMENT.cpus != NULL) {
+    return;
+  }
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    CPU_ZERO(&allowed);
+    CPU_SET(0, &allowed);
+  }
+  PLACEMENT.cpus = malloc(sizeof(int) * CPU_SETSIZE);
+  PLACEMENT.nodes = malloc(sizeof(int) * CPU_SETSIZE);
+
+  int nnodes = 0;
+  for (int node = 0; node < CPU_SETSIZE && CPU_COUNT(&allowed) > 0; node++) {
+    char file[MAX_PATH];
+    snprintf(file, sizeof(file), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(file, "re");
+    if (f == NULL) {
+      // Node numbers can have gaps, but not many
+      if (node > nnodes + 64) {
+        break;
+      }
+      continue;
+    }
+    char list[4096];
+    int before = PLACEMENT.ncpus;
+    if (fgets(list, sizeof(list), f) != NULL) {
+      addCpuList(list, nnodes, &allowed);
+    }
+    nnodes += PLACEMENT.ncpus > before;
+    fclose(f);
+  }
+
+  // Without NUMA information everything is one node
+  int before = PLACEMENT.ncpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      PLACEMENT.cpus[PLACEMENT.ncpus] = cpu;
+      PLACEMENT.nodes[PLACEMENT.ncpus++] = nnodes;
+    }
+  }
+  nnodes += PLACEMENT.ncpus > before;
+
+  PLACEMENT.nnodes = nnodes;
+  PLACEMENT.nodeStart = calloc(nnodes + 1, sizeof(int));
+  PLACEMENT.nodeSize = calloc(nnodes + 1, sizeof(int));
+  PLACEMENT.nodeNext = calloc(nnodes + 1, sizeof(int));
+  for (int i = PLACEMENT.ncpus - 1; i >= 0; i--) {
+    PLACEMENT.nodeStart[PLACEMENT.nodes[i]] = i;
+    PLACEMENT.nodeSize[PLACEMENT.nodes[i]]++;
+  }
+  logPrint("Found %d usable CPUs\n", PLACEMENT.ncpus);
+}
+
+bool demoted(ProcessGroup *pg) {
+  return pg->background && (PLACEMENT.nice != 0 || PLACEMENT.batch);
+}
+
+// Whether starting p involves anything posix_spawn can't do for us
+bool needsPlacement(Process *p, ProcessGroup *pg) {
+  return p->cpu >= 0 || demoted(pg);
+}
+
+/*
+  Choose a CPU for each stage of pg. A group starts on a fresh node
+  when what is left of the current one can't hold all of it.
+*/
+void placeGroup(ProcessGroup *pg) {
+  if (PLACEMENT.mode == PIN_OFF || PLACEMENT.ncpus == 0) {
+    return;
+  }
+  int node;
+  int offset;
+  if (PLACEMENT.mode == PIN_PACK) {
+    int at = PLACEMENT.next % PLACEMENT.ncpus;
+    node = PLACEMENT.nodes[at];
+    offset = at - PLACEMENT.nodeStart[node];
+    if (PLACEMENT.nodeSize[node] - offset < pg->nprocesses &&
+        pg->nprocesses <= PLACEMENT.nodeSize[node]) {
+      node = (node + 1) % PLACEMENT.nnodes;
+      offset = 0;
+    }
+    PLACEMENT.next = PLACEMENT.nodeStart[node] + offset + pg->nprocesses;
+  }
+  else {
+    node = PLACEMENT.nextNode++ % PLACEMENT.nnodes;
+    offset = PLACEMENT.nodeNext[node];
+    if (PLACEMENT.nodeSize[node] - offset < pg->nprocesses &&
+        pg->nprocesses <= PLACEMENT.nodeSize[node]) {
+      offset = 0;
+    }
+    PLACEMENT.nodeNext[node] = (offset + pg->nprocesses) % PLACEMENT.nodeSize[node];
+  }
+
+  for (int i = 0; i < pg->nprocesses; i++) {
+    int at = PLACEMENT.nodeStart[node] + (offset + i) % PLACEMENT.nodeSize[node];
+    pg->processes[i].cpu = PLACEMENT.cpus[at];
+  }
+}
+
+/*
+  Apply p's placement to the calling process, or the calling thread
+  for a builtin running inside the shell
+*/
+void applyPlacement(Process *p, ProcessGroup *pg) {
+  if (p->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(p->cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+      logPrint("Pinning to CPU %d failed: %s\n", p->cpu, strerror(errno));
+    }
+  }
+  if (demoted(pg)) {
+    if (PLACEMENT.batch) {
+      struct sched_param param = {0};
+      sched_setscheduler(0, SCHED_BATCH, &param);
+    }
+    if (PLACEMENT.nice != 0) {
+      setpriority(PRIO_PROCESS, 0, PLACEMENT.nice);
+    }
+  }
+}
+
+// A zero-length "place" event on the process or thread that was placed
+void tracePlacement(Process *p, ProcessGroup *pg, pid_t tid) {
+  if (TRACING && (p->cpu >= 0 || demoted(pg))) {
+    uint64_t now = nowNs();
+    recordTrace(TRACE_PLACE, now, now, tid, p->cpu);
+  }
+}
+
+int pin(int nargs, char **args, int in, int out) {
+  if (nargs == 1) {
+    dprintf(out, "%s nice %d batch %s\n", PIN_NAMES[PLACEMENT.mode], PLACEMENT.nice,
+      PLACEMENT.batch ? "on" : "off");
+    return 0;
+  }
+
+  for (int mode = PIN_OFF; mode <= PIN_SPREAD && nargs == 2; mode++) {
+    if (strcmp(args[1], PIN_NAMES[mode]) == 0) {
+      loadTopology();
+      PLACEMENT.mode = mode;
+      PLACEMENT.next = 0;
+      PLACEMENT.nextNode = 0;
+      memset(PLACEMENT.nodeNext, 0, sizeof(int) * PLACEMENT.nnodes);
+      return 0;
+    }
+  }
+  if (nargs == 3 && strcmp(args[1], "nice") == 0) {
+    char *end;
+    long nice = strtol(args[2], &end, 10);
+    if (*end == '\0' && *args[2] != '\0' && nice >= -20 && nice <= 19) {
+      PLACEMENT.nice = nice;
+      return 0;
+    }
+  }
+  if (nargs == 3 && strcmp(args[1], "batch") == 0 &&
+      (strcmp(args[2], "on") == 0 || strcmp(args[2], "off") == 0)) {
+    PLACEMENT.batch = strcmp(args[2], "on") == 0;
+    return 0;
+  }
+  printError();
+  return -1;
+}
+
+int jobsMax(int nargs, char **args, int in, int out) {
+  if (nargs > 3) {
+    printError();
+    return -1;
+  }
+  if (nargs == 1) {
+    dprintf(out, "%d", JOBS_MAX);
+    if (LOAD_MAX > 0) {
+      dprintf(out, " %.2f", LOAD_MAX);
+    }
+    dprintf(out, "\n");
+    return 0;
+  }
+
+  char *end;
+  long max = strtol(args[1], &end, 10);
+  if (*end != '\0' || max <= 0) {
+    printError();
+    return -1;
+  }
+  double load = 0;
+  if (nargs == 3) {
+    load = strtod(args[2], &end);
+    if (*end != '\0' || load < 0) {
+      printError();
+      return -1;
+    }
+  }
+  JOBS_MAX = max;
+  LOAD_MAX = load;
+  return 0;
+}
+
+int stats(int nargs, char **args, int in, int out) {
+  if (nargs != 1) {
+    logPrint("Incorrect number of args for stats\n");
+    printError();
+    return -1;
+  }
+
+  dprintf(out, "%-24s %llu\n", "cat.bytes", STATS.catBytes);
+  dprintf(out, "%-24s %lu\n", "cat.copy_file_range", STATS.catCopyFileRange);
+  dprintf(out, "%-24s %lu\n", "cat.sendfile", STATS.catSendfile);
+  dprintf(out, "%-24s %lu\n", "cat.splice", STATS.catSplice);
+  dprintf(out, "%-24s %lu\n", "cat.read_write", STATS.catReadWrite);
+  dprintf(out, "%-24s %llu\n", "text.bytes", STATS.textBytes);
+  dprintf(out, "%-24s %s\n", "text.simd", TEXT_SIMD);
+  dprintf(out, "%-24s %lu\n", "glob.words", STATS.globWords);
+  dprintf(out, "%-24s %llu\n", "glob.paths", STATS.globPaths);
+  dprintf(out, "%-24s %lu\n", "dag.lines", STATS.dagLines);
+  dprintf(out, "%-24s %lu\n", "dag.barriers", STATS.dagBarriers);
+  dprintf(out, "%-24s %d\n", "dag.peak_running", STATS.dagPeak);
+  dprintf(out, "%-24s %lu\n", "memo.hits", STATS.memoHits);
+  dprintf(out, "%-24s %lu\n", "memo.misses", STATS.memoMisses);
+  dprintf(out, "%-24s %lu\n", "memo.stored", STATS.memoStored);
+  dprintf(out, "%-24s %lu\n", "memo.evicted", STATS.memoEvicted);
+  dprintf(out, "%-24s %llu\n", "memo.replayed_bytes", STATS.memoReplayedBytes);
+  dprintf(out, "%-24s %lu\n", "timeout.lines", STATS.timeoutLines);
+  dprintf(out, "%-24s %lu\n", "timeout.signals", STATS.timeoutSignals);
+  dprintf(out, "%-24s %lu\n", "history.searches", HISTORY_INDEX.searches);
+  dprintf(out, "%-24s %llu\n", "history.candidates", HISTORY_INDEX.candidates);
+  dprintf(out, "%-24s %zu\n", "history.trigrams", HISTORY_INDEX.used);
+  dprintf(out, "%-24s %lu\n", "arena.lines", STATS.arenaResets);
+  dprintf(out, "%-24s %lu\n", "arena.chunk_allocs", STATS.arenaChunks);
+  dprintf(out, "%-24s %zu\n", "arena.peak_bytes", STATS.arenaPeakBytes);
+  dprintf(out, "%-24s %lu\n", "reap.children", STATS.reaped);
+  dprintf(out, "%-24s %lu\n", "reap.wakeups", STATS.reapWakeups);
+  dprintf(out, "%-24s %d\n", "sched.slots", JOBS_MAX);
+  dprintf(out, "%-24s %lu\n", "sched.groups", STATS.schedGroups);
+  dprintf(out, "%-24s %lu\n", "sched.queued", STATS.schedQueued);
+  dprintf(out, "%-24s %.3f\n", "sched.wait_ms", STATS.schedWaitNs / 1e6);
+  dprintf(out, "%-24s %.3f\n", "sched.utilisation",
+    STATS.schedSlotNs ? (double)STATS.schedBusyNs / STATS.schedSlotNs : 0.0);
+  dprintf(out, "%-24s %.3f\n", "sched.last_wait_ms", STATS.lastWaitNs / 1e6);
+  dprintf(out, "%-24s %.3f\n", "sched.last_utilisation", STATS.lastUtilisation);
+  return 0;
+}
+
+int history(int nargs, char **args, int in, int out) {
+  if (nargs != 1) {
+    logPrint("Incorrect number of args for history\n");
+    printError();
+    return -1;
+  }
+
+  // Format into one large buffer and write it out in big chunks
+  char buf[HISTORY_WRITE_SIZE];
+  size_t used = 0;
+  int first = HISTORY.count > HISTORY.limit ? HISTORY.count - HISTORY.limit : 0;
+  for (int i = first; i < HISTORY.count; i++) {
+    size_t len;
+    char *entry = historyEntry(HISTORY.base + i + 1, &len);
+    if (used + len + 16 > sizeof(buf)) {
+      if (write(out, buf, used) < 0) {
+        return -1;
+      }
+      used = 0;
+    }
+    if (len + 16 > sizeof(buf)) {
+      dprintf(out, "%5d %s\n", HISTORY.base + i + 1, entry);
+      continue;
+    }
+    used += snprintf(buf + used, 16, "%5d ", HISTORY.base + i + 1);
+    memcpy(buf + used, entry, len);
+    used += len;
+    buf[used++] = '\n';
+  }
+  if (used > 0 && write(out, buf, used) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int trace(int nargs, char **args, int in, int out) {
+  if (nargs == 1) {
+    unsigned long kept = TRACE_NEXT < TRACE_EVENTS ? TRACE_NEXT : TRACE_EVENTS;
+    dprintf(out, "trace %s, %lu events\n", TRACING ? "on" : "off", kept);
+    return 0;
+  }
+  if (nargs == 2 && strcmp(args[1], "on") == 0) {
+    startTracing();
+    return 0;
+  }
+  if (nargs == 2 && strcmp(args[1], "off") == 0) {
+    TRACING = false;
+    return 0;
+  }
+  if (nargs == 3 && strcmp(args[1], "dump") == 0 && dumpTrace(args[2]) == 0) {
+    return 0;
+  }
+  printError();
+  return -1;
+}
+
+int exitShell(int nargs, char **args, int in, int out) {
+  if (nargs > 1) {
+    logPrint("Wrong number of args for exit (given %d, expected 1)\n", nargs);
+    printError();
+    return -1;
+  }
+  exit(0);
+}
+
+int showPath(int nargs, char **args, int in, int out) {
+  dprintf(out, "%s\n", SEARCH_PATH);
+  return 0;
+}
+
+/*
+  Builtins read from in and write to out rather than stdin/stdout, so
+  the ones that leave shell state alone can run on a thread when they
+  are part of a pipeline. The rest still get a process of their own.
+  A builtin with accepts only stands in for the command of the same
+  name when accepts() is happy with the arguments.
+*/
+typedef struct {
+  char *name;
+  int (*run)(int nargs, char **args, int in, int out);
+  bool threaded;
+  bool (*accepts)(int nargs, char **args);
+} BuiltIn;
+
+BuiltIn BUILTINS[] = {
+  {"exit", exitShell, false, NULL},
+  {"path", path, false, NULL},
+  {"showpath", showPath, true, NULL},
+  {"cd", cd, false, NULL},
+  {"cat", cat, true, NULL},
+  {"wc", wc, true, wcAccepts},
+  {"head", head, true, lineCountAccepts},
+  {"tail", tail, true, lineCountAccepts},
+  {"grep", grep, true, grepAccepts},
+  {"history", history, true, NULL},
+  {"hash", hash, false, NULL},
+  {"stats", stats, true, NULL},
+  {"jobs", jobs, false, NULL},
+  {"fg", fg, false, NULL},
+  {"bg", bg, false, NULL},
+  {"wait", waitJobs, false, NULL},
+  {"jobs-max", jobsMax, false, NULL},
+  {"trace", trace, false, NULL},
+  {"pin", pin, false, NULL},
+  {NULL, NULL, false, NULL},
+};
+
+// Builtins whose output depends only on their arguments, input and the
+// files they read. The rest read or change the shell's own state.
+char *PURE_BUILTINS[] = {"cat", "wc", "head", "tail", "grep", NULL};
+
+bool inList(char *name, char **list) {
+  for (; *list != NULL; list++) {
+    if (strcmp(name, *list) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+BuiltIn *findBuiltIn(Process *p) {
+  for (BuiltIn *b = BUILTINS; b->name != NULL; b++) {
+    if (strcmp(p->args[0], b->name) == 0) {
+      return b->accepts == NULL || b->accepts(p->nargs, p->args) ? b : NULL;
+    }
+  }
+  return NULL;
+}
+
+int tryBuiltIn(Process *p, int in, int out) {
+  logPrint("Trying builtin for %s\n", p->args[0]);
+  BuiltIn *b = findBuiltIn(p);
+  if (b == NULL) {
+    return 1;
+  }
+  return b->run(p->nargs, p->args, in, out);
+}
+
+bool isBuiltIn(Process *p) {
+  return findBuiltIn(p) != NULL;
+}
+
+bool isThreadedBuiltIn(Process *p) {
+  BuiltIn *b = findBuiltIn(p);
+  return b != NULL && b->threaded;
+}
+
+int findOnPath(char *dest, char *tail) {
+  HashEntry *e = lookupCommand(tail);
+  if (e->path == NULL) {
+    logPrint("Command not found on path: %s\n", tail);
+    printError();
+    return -1;
+  }
+  strcpy(dest, e->path);
+  return 0;
+}
+
+/*
+  Open p's redirections, replacing *in and *out with the new fds. Both
+  are opened close-on-exec, so the shell can use them directly and a
+  child only keeps them once they are dup'ed onto its stdio. On failure
+  nothing is left open and *in and *out are unchanged.
+*/
+int openRedirects(Process *p, int *in, int *out) {
+  int fdin = *in;
+  int fdout = *out;
+
+  if (p->rfout != NULL) {
+    logPrint("Redirecting output to %s\n", p->rfout);
+    uint64_t start = traceStart();
+    fdout = open(p->rfout, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, S_IRWXU);
+    traceEnd(TRACE_REDIRECT, start, fdout);
+    if (fdout < 0) {
+      logPrint("Failed to open file for output: %s\n", p->rfout);
+      printError();
+      return -1;
+    }
+  }
+
+  if (p->hereFd >= 0) {
+    // A copy, so whoever reads it can close it like an opened file
+    fdin = fcntl(p->hereFd, F_DUPFD_CLOEXEC, 0);
+    if (fdin < 0) {
+      printError();
+      if (fdout != *out) {
+        close(fdout);
+      }
+      return -1;
+    }
+  }
+  else if (p->rfin != NULL) {
+    logPrint("Redirecting input to %s\n", p->rfin);
+    uint64_t start = traceStart();
+    fdin = open(p->rfin, O_RDONLY|O_CLOEXEC);
+    traceEnd(TRACE_REDIRECT, start, fdin);
+    if (fdin < 0) {
+      logPrint("Failed to open file for input: %s\n", p->rfin);
+      printError();
+      if (fdout != *out) {
+        close(fdout);
+      }
+      return -1;
+    }
+  }
+
+  *in = fdin;
+  *out = fdout;
+  return 0;
+}
+
+// Close whatever openRedirects() opened on top of in and out
+void closeRedirects(int in, int out, int origIn, int origOut) {
+  if (in != origIn) {
+    close(in);
+  }
+  if (out != origOut) {
+    close(out);
+  }
+}
+
+/*
+  Child side only: apply p's redirections over the stdio that piping
+  already set up
+*/
+int redirectIO(Process *p) {
+  int in = STDIN_FILENO;
+  int out = STDOUT_FILENO;
+  if (openRedirects(p, &in, &out) != 0) {
+    return -1;
+  }
+  if (out != STDOUT_FILENO) {
+    dup2(out, STDOUT_FILENO);
+    close(out);
+  }
+  if (in != STDIN_FILENO) {
+    dup2(in, STDIN_FILENO);
+    close(in);
+  }
+  return 0;
+}
+
+int executeChild(Process *p, char *fullPath) {
+  // Possible error: not using full path for first arg?
+  logPrint("Exec'ing process: %s\n", fullPath);
+  execv(fullPath, p->args);
+  logPrint("execv failed\n");
+  perror("execv");
+  _exit(1);
+}
+
+/*
+  Launch an external command with fdin/fdout as its stdin/stdout and
+  its own redirections applied on top. The shell's own stdio is never
+  touched. fdin and fdout are left open for the caller to close.
+*/
+int spawnProcess(Process *p, ProcessGroup *pg, char *fullPath, int fdin, int fdout) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+
+  if (fdin != STDIN_FILENO) {
+    posix_spawn_file_actions_adddup2(&actions, fdin, STDIN_FILENO);
+  }
+  if (fdout != STDOUT_FILENO) {
+    posix_spawn_file_actions_adddup2(&actions, fdout, STDOUT_FILENO);
+  }
+  // Redirection overrides piping
+  if (p->rfout != NULL) {
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, p->rfout,
+      O_CREAT|O_WRONLY|O_TRUNC, S_IRWXU);
+  }
+  if (p->hereFd >= 0) {
+    posix_spawn_file_actions_adddup2(&actions, p->hereFd, STDIN_FILENO);
+  }
+  else if (p->rfin != NULL) {
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, p->rfin,
+      O_RDONLY, 0);
+  }
+
+  // The child should not inherit the shell's blocked SIGCHLD
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t empty;
+  sigemptyset(&empty);
+  posix_spawnattr_setsigmask(&attr, &empty);
+  short flags = POSIX_SPAWN_SETSIGMASK;
+
+  // Nor the job control signals the shell ignores
+  if (JOB_CONTROL) {
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, pg->pgid);
+    flags |= POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP;
+    if (pg->foreground) {
+      posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+  }
+  else if (pg->isolated) {
+    posix_spawnattr_setpgroup(&attr, pg->pgid);
+    flags |= POSIX_SPAWN_SETPGROUP;
+  }
+  posix_spawnattr_setflags(&attr, flags);
+
+  pid_t pid;
+  uint64_t start = traceStart();
+  int rc = posix_spawn(&pid, fullPath, &actions, &attr, p->args, environ);
+  traceEnd(TRACE_SPAWN, start, rc == 0 ? pid : -1);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (rc != 0) {
+    logPrint("posix_spawn failed for %s: %s\n", fullPath, strerror(rc));
+    printError();
+    return -1;
+  }
+
+  logPrint("Spawned %s as pid %d\n", fullPath, pid);
+  return pid;
+}
+
+int forkProcess(Process *p, ProcessGroup *pg, char *fullPath, int fdin, int fdout) {
+  uint64_t start = traceStart();
+  int rc = fork();
+  if (rc < 0) {
+    logPrint("Fork failed\n");
+    perror("fork");
+    exit(1);
+  }
+  else if (rc == 0) {
+    enterProcessGroup(pg);
+    applyPlacement(p, pg);
+    if (fdin != STDIN_FILENO) {
+      dup2(fdin, STDIN_FILENO);
+    }
+    if (fdout != STDOUT_FILENO) {
+      dup2(fdout, STDOUT_FILENO);
+    }
+    if (redirectIO(p) != 0) {
+      _exit(1);
+    }
+    executeChild(p, fullPath);
+  }
+  traceEnd(TRACE_FORK, start, rc);
+  return rc;
+}
+
+int launchProcess(Process *p, ProcessGroup *pg, char *fullPath, int fdin, int fdout) {
+  int rc = USE_SPAWN && !needsPlacement(p, pg)
+    ? spawnProcess(p, pg, fullPath, fdin, fdout)
+    : forkProcess(p, pg, fullPath, fdin, fdout);
+  if (rc > 0) {
+    tracePlacement(p, pg, rc);
+    p->pid = rc;
+    p->executed = true;
+    joinProcessGroup(p, pg);
+  }
+  return rc;
+}
+
+/*
+  Builtins write to the fds they are given, so a redirected builtin
+  gets the opened file directly and the shell's stdio stays as it is
+*/
+int runBuiltIn(Process *p) {
+  // Anything the shell printed so far belongs on the real stdout
+  fflush(stdout);
+
+  int in = STDIN_FILENO;
+  int out = STDOUT_FILENO;
+  int rc = openRedirects(p, &in, &out);
+  if (rc != 0) {
+    logPrint("Opening redirections failed\n");
+  }
+  else {
+    rc = tryBuiltIn(p, in, out);
+    closeRedirects(in, out, STDIN_FILENO, STDOUT_FILENO);
+  }
+
+  return rc < 0 ? -1 : 0;
+}
+
+// Usage between two getrusage() calls, for work done inside the shell
+void rusageSince(struct rusage *before, struct rusage *after) {
+  after->ru_utime.tv_sec -= before->ru_utime.tv_sec;
+  after->ru_utime.tv_usec -= before->ru_utime.tv_usec;
+  after->ru_stime.tv_sec -= before->ru_stime.tv_sec;
+  after->ru_stime.tv_usec -= before->ru_stime.tv_usec;
+  after->ru_nvcsw -= before->ru_nvcsw;
+  after->ru_nivcsw -= before->ru_nivcsw;
+  after->ru_minflt -= before->ru_minflt;
+  after->ru_majflt -= before->ru_majflt;
+}
+
+int runSingleProcess(Process *p, ProcessGroup *pg) {
+  if (isBuiltIn(p)) {
+    struct rusage before;
+    getrusage(RUSAGE_SELF, &before);
+    clock_gettime(CLOCK_MONOTONIC, &p->started);
+    int rc = runBuiltIn(p);
+    clock_gettime(CLOCK_MONOTONIC, &p->ended);
+    if (TRACING) {
+      recordTrace(TRACE_BUILTIN, timespecNs(&p->started), timespecNs(&p->ended), getpid(), rc);
+    }
+    getrusage(RUSAGE_SELF, &p->rusage);
+    rusageSince(&before, &p->rusage);
+    p->status = rc == 0 ? 0 : 1 << 8;
+    return rc;
+  }
+
+  char fullPath[MAX_PATH];
+  if (findOnPath(fullPath, p->args[0]) != 0) {
+    return -1;
+  }
+  logPrint("Executing external command %s\n", p->args[0]);
+  return launchProcess(p, pg, fullPath, STDIN_FILENO, STDOUT_FILENO) < 0 ? -1 : 0;
+}
+
+void setupPipes(int fdin, int *fdpipe, bool shouldpipeout) {
+  if (fdin != STDIN_FILENO) {
+    logPrint("Duping pipe in\n");
+    dup2(fdin, STDIN_FILENO);
+  }
+
+  if (shouldpipeout) {
+    logPrint("Duping pipe out\n");
+    dup2(fdpipe[1], STDOUT_FILENO);
+  }
+}
+
+/*
+  Builtins that appear in a pipeline still need a process of their own
+  so that they can run concurrently with the other stages
+*/
+void forkBuiltIn(Process *p, ProcessGroup *pg, int fdin, int *fdpipe, bool shouldpipeout) {
+  // Flush now so the child doesn't inherit and repeat buffered output
+  fflush(stdout);
+
+  uint64_t start = traceStart();
+  int rc = fork();
+  if (rc < 0) {
+    logPrint("Fork failed\n");
+    perror("fork");
+    exit(1);
+  }
+  else if (rc == 0) {
+    // Piping, then redirection on top of it, all in the child
+    enterProcessGroup(pg);
+    applyPlacement(p, pg);
+    setupPipes(fdin, fdpipe, shouldpipeout);
+    // Holding on to the pipe's read end would keep our writes from
+    // ever failing once the next stage exits
+    if (shouldpipeout) {
+      close(fdpipe[0]);
+      close(fdpipe[1]);
+    }
+    if (fdin != STDIN_FILENO) {
+      close(fdin);
+    }
+    if (redirectIO(p) != 0) {
+      _exit(1);
+    }
+    rc = tryBuiltIn(p, STDIN_FILENO, STDOUT_FILENO);
+    fflush(stdout);
+    _exit(rc == 0 ? 0 : 1);
+  }
+
+  // Save pid to wait on later
+  traceEnd(TRACE_FORK, start, rc);
+  tracePlacement(p, pg, rc);
+  logPrint("Process %d was given pid %d\n", p->pid, rc);
+  p->pid = rc;
+  p->executed = true;
+  joinProcessGroup(p, pg);
+}
+
+void *builtInThread(void *arg) {
+  BuiltInThread *t = arg;
+
+  // A reader that goes away should only fail this stage's writes
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  // Placed like a child would be, but only this thread
+  applyPlacement(t->p, t->pg);
+  tracePlacement(t->p, t->pg, gettid());
+
+  // Redirection overrides piping, as it does for a child
+  Process *p = t->p;
+  int in = t->in;
+  int out = t->out;
+  uint64_t start = traceStart();
+  int rc = openRedirects(p, &in, &out);
+  if (rc == 0) {
+    rc = tryBuiltIn(p, in, out);
+  }
+
+  // Closing our ends is what lets the neighbouring stages see EOF
+  int fds[] = {in, out, t->in, t->out};
+  for (int i = 0; i < 4; i++) {
+    bool seen = false;
+    for (int j = 0; j < i; j++) {
+      seen |= fds[j] == fds[i];
+    }
+    if (!seen && fds[i] > STDERR_FILENO) {
+      close(fds[i]);
+    }
+  }
+  free(COPY_BUFFER);
+  COPY_BUFFER = NULL;
+
+  getrusage(RUSAGE_THREAD, &t->rusage);
+  traceEnd(TRACE_BUILTIN, start, rc);
+  t->rc = rc;
+  __atomic_store_n(&t->done, true, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  if (write(THREAD_EVENT_FD, &one, sizeof(one)) < 0) {
+    logPrint("Failed to signal builtin completion\n");
+  }
+  return NULL;
+}
+
+/*
+  Run a builtin stage of a pipeline on a thread inside the shell. The
+  thread takes ownership of fdin and fdout and closes them when done.
+*/
+void startBuiltInThread(Process *p, ProcessGroup *pg, int fdin, int fdout) {
+  // Nothing the shell has buffered may land after the builtin's output
+  fflush(stdout);
+
+  BuiltInThread *t = calloc(1, sizeof(*t));
+  t->p = p;
+  t->pg = pg;
+  t->in = fdin;
+  t->out = fdout;
+  if (pthread_create(&t->thread, NULL, builtInThread, t) != 0) {
+    perror("pthread_create");
+    exit(1);
+  }
+
+  t->next = THREADS;
+  THREADS = t;
+  N_THREADS++;
+  p->pid = 0;
+  p->executed = true;
+  pg->threads++;
+  pg->running++;
+  clock_gettime(CLOCK_MONOTONIC, &p->started);
+}
+
+int runProcess(Process *p, ProcessGroup *pg, int fdin, bool shouldpipeout) {
+  int fdpipe[2] = {-1, -1};
+  uint64_t start = traceStart();
+  if (shouldpipeout && pipe2(fdpipe, O_CLOEXEC) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  if (shouldpipeout) {
+    traceEnd(TRACE_PIPE, start, fdpipe[0]);
+  }
+
+  // Resolve external commands here so the lookup is cached in the shell.
+  // Empty processes (e.g. from a trailing &) have nothing to run. A
+  // background group can outlive the line, and the shell would change
+  // the history or state a thread of it is still reading, so its
+  // builtins get processes.
+  char fullPath[MAX_PATH];
+  if (p->nargs == 0) {
+    logPrint("Skipping empty process\n");
+  }
+  else if (isThreadedBuiltIn(p) && !DETACHED_LAUNCH && !pg->background) {
+    startBuiltInThread(p, pg, fdin, shouldpipeout ? fdpipe[1] : STDOUT_FILENO);
+    return fdpipe[0];
+  }
+  else if (isBuiltIn(p)) {
+    forkBuiltIn(p, pg, fdin, fdpipe, shouldpipeout);
+  }
+  else if (findOnPath(fullPath, p->args[0]) == 0) {
+    launchProcess(p, pg, fullPath, fdin, shouldpipeout ? fdpipe[1] : STDOUT_FILENO);
+  }
+
+  /*
+    The child now has its own copies of fdin and fdpipe.
+    Close the pipe in and pipe out values since we don't
+    need them anymore
+  */
+  if (fdin != STDIN_FILENO) {
+    close(fdin);
+  }
+  if (fdpipe[1] >= 0) {
+    close(fdpipe[1]);
+  }
+
+  return fdpipe[0];
+}
+
+long long elapsedNs(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000LL + (to->tv_nsec - from->tv_nsec);
+}
+
+/*
+  Groups on a line are started make -j style: each one takes a slot
+  until it finishes, and the rest wait in line order for a slot to
+  free up. Groups are often I/O bound, so the default never drops
+  below JOBS_MAX_FLOOR even on small machines.
+*/
+void initJobSlots() {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  JOBS_MAX = cpus > JOBS_MAX_FLOOR ? cpus : JOBS_MAX_FLOOR;
+
+  char *max = getenv("WISH_JOBS_MAX");
+  if (max != NULL && atoi(max) > 0) {
+    JOBS_MAX = atoi(max);
+  }
+  char *load = getenv("WISH_LOAD_MAX");
+  if (load != NULL) {
+    LOAD_MAX = atof(load) > 0 ? atof(load) : 0;
+  }
+}
+
+int busySlots(int npgs, ProcessGroup *pgs) {
+  int busy = 0;
+  for (int i = 0; i < npgs; i++) {
+    // A stopped group won't finish on its own, so it gives up its slot
+    if (pgs[i].run && pgs[i].running > 0 && !groupStopped(&pgs[i])) {
+      busy++;
+    }
+  }
+  return busy;
+}
+
+bool admitGroup(int busy) {
+  // Something has to run or nothing will ever free up
+  if (busy == 0) {
+    return true;
+  }
+  if (busy >= JOBS_MAX) {
+    return false;
+  }
+  double load;
+  if (LOAD_MAX > 0 && getloadavg(&load, 1) == 1 && load >= LOAD_MAX) {
+    logPrint("Load %.2f over %.2f, holding back group\n", load, LOAD_MAX);
+    return false;
+  }
+  return true;
+}
+
+// Report how long the line's groups queued and how busy its slots were
+void recordSchedule(int npgs, ProcessGroup *pgs) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  unsigned long long busy = 0;
+  for (int i = 0; i < npgs; i++) {
+    struct timespec *end = &pgs[i].launched;
+    for (int j = 0; j < pgs[i].nprocesses; j++) {
+      Process *p = &pgs[i].processes[j];
+      struct timespec *ended = p->reaped ? &p->ended : &now;
+      if (p->executed && elapsedNs(end, ended) > 0) {
+        end = ended;
+      }
+    }
+    busy += elapsedNs(&pgs[i].launched, end);
+  }
+
+  int slots = npgs < JOBS_MAX ? npgs : JOBS_MAX;
+  unsigned long long span = elapsedNs(&LINE_LAUNCHED, &now) * slots;
+  STATS.schedBusyNs += busy;
+  STATS.schedSlotNs += span;
+  STATS.lastUtilisation = span ? (double)busy / span : 0;
+  logPrint("Line queued for %.3fms, slot utilisation %.3f\n",
+    STATS.lastWaitNs / 1e6, STATS.lastUtilisation);
+}
+
+void launchGroups(int npgs, ProcessGroup *pgs) {
+  logPrint("Running all groups in %d slots\n", JOBS_MAX);
+  clock_gettime(CLOCK_MONOTONIC, &LINE_LAUNCHED);
+  STATS.lastWaitNs = 0;
+
+  int busy = 0;
+  for (int i = 0; i < npgs; i++) {
+    ProcessGroup *pg = &pgs[i];
+    if (!admitGroup(busy)) {
+      STATS.schedQueued++;
+      do {
+        waitForEvents();
+        busy = busySlots(i, pgs);
+      } while (!admitGroup(busy));
+    }
+    // The line's deadline passed while this group waited for a slot
+    if (pg->expired) {
+      logPrint("Not starting ProcessGroup %d after its deadline\n", pg->id);
+      continue;
+    }
+
+    pg->run = true;
+    clock_gettime(CLOCK_MONOTONIC, &pg->launched);
+    STATS.lastWaitNs += elapsedNs(&LINE_LAUNCHED, &pg->launched);
+    STATS.schedGroups++;
+    logPrint("Running ProcessGroup %d\n", pg->id);
+    placeGroup(pg);
+
+    int pipein = STDIN_FILENO;
+    for (int j = 0; j < pg->nprocesses; j++) {
+      Process *p = &(pg->processes[j]);
+      logPrint("\tRunning Processs %d\n", p->pid);
+
+      bool shouldpipeout = j == pg->nprocesses-1 ? false : true;
+      pipein = runProcess(p, pg, pipein, shouldpipeout);
+      // Builtin threads have no pid and are already accounted for
+      if (p->executed && p->pid > 0) {
+        trackChild(p, pg);
+      }
+      if (pipein == -1) {
+        logPrint("Last Process, pipein value is -1\n");
+      }
+    }
+    if (pg->running > 0) {
+      busy++;
+    }
+  }
+  STATS.schedWaitNs += STATS.lastWaitNs;
+}
+
+void waitGroups(int npgs, ProcessGroup *pgs) {
+  // Wait on all processes in all groups. Every wakeup reaps whatever
+  // has exited, so a slow group never holds up reaping the others.
+  logPrint("Waiting on all groups\n");
+  for (int i = 0; i < npgs; i++) {
+    logPrint("Waiting on %d Processes in ProcessGroup %d\n", pgs[i].running, pgs[i].id);
+    if (waitForeground(&pgs[i])) {
+      // Stopped from the terminal, so it carries on as a job
+      Job *job = makeJob(&pgs[i], true);
+      if (pgs[i].foreground) {
+        tcgetattr(STDIN_FILENO, &job->tmodes);
+        job->hasTmodes = true;
+      }
+      printf("\n[%d]  Stopped\t\t%s\n", job->id, job->command);
+      pgs[i].running = 0;
+      continue;
+    }
+    for (int j = 0; j < pgs[i].nprocesses; j++) {
+      printProcess(&pgs[i].processes[j]);
+    }
+  }
+  giveTerminalTo(SHELL_PGID, &SHELL_TMODES);
+  if (pgs[0].launched.tv_sec != 0) {
+    recordSchedule(npgs, pgs);
+  }
+}
+
+void launchLine(int npgs, ProcessGroup *pgs){
+  if (EVENT_FD < 0) {
+    initEvents();
+  }
+
+  // An echoed !N line has to come out before anything its children print
+  fflush(stdout);
+
+  // The last group holds the terminal unless the whole line is a job
+  if (JOB_CONTROL && !pgs[npgs-1].background) {
+    pgs[npgs-1].foreground = true;
+  }
+
+  if (npgs == 1 && pgs[0].nprocesses == 1 && !pgs[0].background &&
+      pgs[0].processes[0].nargs > 0 && !(DETACHED_LAUNCH && isThreadedBuiltIn(&pgs[0].processes[0]))) {
+    logPrint("Running a single process\n");
+    pgs[0].run = true;
+    placeGroup(&pgs[0]);
+    runSingleProcess(&pgs[0].processes[0], &pgs[0]);
+    if (pgs[0].processes[0].executed) {
+      trackChild(&pgs[0].processes[0], &pgs[0]);
+    }
+  }
+  else {
+    launchGroups(npgs, pgs);
+  }
+}
+
+/*
+  Plan cache. The parse of every line of a batch script is serialised
+  into DIR/<hash>.plan, keyed by an FNV-1a hash of the script and the
+  initial search path. Later runs of the same script map that file and
+  build each line's ProcessGroups straight from it, with the strings
+  pointing into the mapping, so no line is tokenised again.
+
+  A plan is a header followed by one record per line, in order:
+    u32 kind           PLAN_PARSED or PLAN_LIVE
+    u32 npgs           then per group:
+      u32 background, u32 nprocesses, then per process:
+        u32 nargs, the args, rfin, rfout
+  where each string is a u32 length (PLAN_NULL for none) followed by
+  that many bytes and a NUL. Lines that can't be replayed (history
+  expansion, parse errors) are PLAN_LIVE and are parsed as usual. A
+  script that exits early leaves a plan covering the lines it reached.
+*/
+#define PLAN_MAGIC "wishpln1"
+#define PLAN_PARSED 1
+#define PLAN_LIVE 2
+#define PLAN_NULL UINT32_MAX
+
+typedef struct {
+  char *dir;
+  char *file;
+  // Replaying from an existing plan
+  char *map;
+  size_t size;
+  size_t pos;
+  // Or recording a new one
+  FILE *record;
+  char *recordBuf;
+  size_t recordSize;
+  pid_t owner;
+} Plan;
+
+Plan PLAN;
+
+uint64_t fnv1a(const void *data, size_t len, uint64_t h) {
+  const unsigned char *c = data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= c[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void putPlanU32(uint32_t v) {
+  fwrite(&v, sizeof(v), 1, PLAN.record);
+}
+
+void putPlanString(char *s) {
+  if (s == NULL) {
+    putPlanU32(PLAN_NULL);
+    return;
+  }
+  uint32_t len = strlen(s);
+  putPlanU32(len);
+  fwrite(s, 1, len + 1, PLAN.record);
+}
+
+void recordPlanLine(int npgs, ProcessGroup *pgs) {
+  if (npgs < 0) {
+    putPlanU32(PLAN_LIVE);
+    return;
+  }
+  putPlanU32(PLAN_PARSED);
+  putPlanU32(npgs);
+  for (int i = 0; i < npgs; i++) {
+    putPlanU32(pgs[i].background);
+    putPlanU32(pgs[i].nprocesses);
+    for (int j = 0; j < pgs[i].nprocesses; j++) {
+      Process *p = &pgs[i].processes[j];
+      putPlanU32(p->nargs);
+      for (int k = 0; k < p->nargs; k++) {
+        putPlanString(p->args[k]);
+      }
+      putPlanString(p->rfin);
+      putPlanString(p->rfout);
+    }
+  }
+}
+
+bool getPlanU32(uint32_t *v) {
+  if (PLAN.pos + sizeof(*v) > PLAN.size) {
+    return false;
+  }
+  memcpy(v, PLAN.map + PLAN.pos, sizeof(*v));
+  PLAN.pos += sizeof(*v);
+  return true;
+}
+
+bool getPlanString(char **s) {
+  uint32_t len;
+  if (!getPlanU32(&len)) {
+    return false;
+  }
+  if (len == PLAN_NULL) {
+    *s = NULL;
+    return true;
+  }
+  if (PLAN.pos + len + 1 > PLAN.size || PLAN.map[PLAN.pos + len] != '\0') {
+    return false;
+  }
+  *s = PLAN.map + PLAN.pos;
+  PLAN.pos += len + 1;
+  return true;
+}
+
+/*
+  Build the next line's groups from the plan. Returns the number of
+  groups, or -2 if the line has to be parsed live.
+*/
+int replayPlanLine(Arena *a, ProcessGroup **pgsPtr) {
+  uint32_t kind, npgs;
+  if (!getPlanU32(&kind) || kind != PLAN_PARSED || !getPlanU32(&npgs)) {
+    return -2;
+  }
+  // Counts can't be more than the file has bytes, which keeps a corrupt
+  // one from asking the arena for gigabytes
+  if (npgs > PLAN.size) {
+    goto corrupt;
+  }
+
+  ProcessGroup *pgs = arenaAlloc(a, sizeof(ProcessGroup) * (npgs ? npgs : 1));
+  for (uint32_t i = 0; i < npgs; i++) {
+    ProcessGroup *pg = &pgs[i];
+    uint32_t background, nprocesses;
+    initializeProcessGroup(pg, i);
+    if (!getPlanU32(&background) || !getPlanU32(&nprocesses) || nprocesses > PLAN.size) {
+      goto corrupt;
+    }
+    pg->background = background;
+    pg->nprocesses = nprocesses;
+    pg->processes = arenaAlloc(a, sizeof(Process) * (nprocesses ? nprocesses : 1));
+    for (uint32_t j = 0; j < nprocesses; j++) {
+      Process *p = &pg->processes[j];
+      uint32_t nargs;
+      initializeProcess(p, j);
+      if (!getPlanU32(&nargs) || nargs > PLAN.size) {
+        goto corrupt;
+      }
+      p->nargs = nargs;
+      p->args = arenaAlloc(a, sizeof(char *) * (nargs + 1));
+      for (uint32_t k = 0; k < nargs; k++) {
+        if (!getPlanString(&p->args[k])) {
+          goto corrupt;
+        }
+      }
+      p->args[nargs] = NULL;
+      if (!getPlanString(&p->rfin) || !getPlanString(&p->rfout)) {
+        goto corrupt;
+      }
+    }
+  }
+  *pgsPtr = pgs;
+  return npgs;
+
+corrupt:
+  // Stop trusting the file; the rest of the script is parsed live
+  logPrint("Plan %s is corrupt at %zu\n", PLAN.file, PLAN.pos);
+  PLAN.pos = PLAN.size;
+  return -2;
+}
+
+void savePlan() {
+  if (PLAN.record == NULL || getpid() != PLAN.owner) {
+    return;
+  }
+  fclose(PLAN.record);
+  PLAN.record = NULL;
+
+  // Write to a temporary name first so readers never see half a plan
+  char tmp[MAX_PATH];
+  snprintf(tmp, sizeof(tmp), "%s.%d", PLAN.file, getpid());
+  int fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return;
+  }
+  bool ok = write(fd, PLAN_MAGIC, strlen(PLAN_MAGIC)) == (ssize_t)strlen(PLAN_MAGIC) &&
+    write(fd, PLAN.recordBuf, PLAN.recordSize) == (ssize_t)PLAN.recordSize;
+  close(fd);
+  if (!ok || rename(tmp, PLAN.file) != 0) {
+    unlink(tmp);
+  }
+  free(PLAN.recordBuf);
+}
+
+/*
+  Look for a plan of the script in in. If there is one it is mapped for
+  replay, otherwise this run records one and saves it on exit.
+*/
+void openPlan(char *dir, Input *in) {
+  if (dir == NULL || *dir == '\0' || in->map == NULL) {
+    return;
+  }
+
+  uint64_t h = fnv1a(in->map, in->size, 14695981039346656037ULL);
+  h = fnv1a(SEARCH_PATH, strlen(SEARCH_PATH) + 1, h);
+  char file[MAX_PATH];
+  snprintf(file, sizeof(file), "%s/%016llx.plan", dir, (unsigned long long)h);
+  PLAN.file = strdup(file);
+  PLAN.owner = getpid();
+
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= strlen(PLAN_MAGIC)) {
+    PLAN.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (PLAN.map != MAP_FAILED && memcmp(PLAN.map, PLAN_MAGIC, strlen(PLAN_MAGIC)) == 0) {
+      PLAN.size = st.st_size;
+      PLAN.pos = strlen(PLAN_MAGIC);
+      logPrint("Replaying plan %s\n", file);
+      close(fd);
+      return;
+    }
+    if (PLAN.map != MAP_FAILED) {
+      munmap(PLAN.map, st.st_size);
+    }
+    PLAN.map = NULL;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  PLAN.record = open_memstream(&PLAN.recordBuf, &PLAN.recordSize);
+  atexit(savePlan);
+}
+
+// Parse a line, or take it from the plan when there is one
+int planLine(Arena *a, ProcessGroup **pgsPtr, char *line, size_t len) {
+  if (PLAN.map != NULL) {
+    int npgs = replayPlanLine(a, pgsPtr);
+    if (npgs != -2) {
+      // The line still goes into history as if it had been parsed
+      return saveCommandToHistory(line, len) < 0 ? -1 : npgs;
+    }
+    return parseLine(a, pgsPtr, line, len);
+  }
+
+  // History expansion makes a line depend on what ran before it, a
+  // glob on the files that exist when it runs, and a here-document's
+  // body is read from the lines after it. Decide before parsing, which
+  // may read further lines.
+  bool live = memchr(line, '!', len) != NULL || memmem(line, len, "<<", 2) != NULL ||
+    hasGlobChars(line, len);
+  int npgs = parseLine(a, pgsPtr, line, len);
+  if (PLAN.record != NULL) {
+    recordPlanLine(live ? -1 : npgs, *pgsPtr);
+  }
+  return npgs;
+}
+
+/*
+  A line starting with time [-j] is run as usual and then reported on.
+  The prefix is dropped from the first process here so nothing else
+  has to know about it.
+*/
+TimeMode stripTimePrefix(Line *l) {
+  if (l->npgs <= 0) {
+    return TIME_OFF;
+  }
+  Process *p = &l->pgs[0].processes[0];
+  if (p->nargs == 0 || strcmp(p->args[0], "time") != 0) {
+    return TIME_OFF;
+  }
+
+  TimeMode mode = TIME_TEXT;
+  int skip = 1;
+  if (p->nargs > 1 && strcmp(p->args[1], "-j") == 0) {
+    mode = TIME_JSON;
+    skip = 2;
+  }
+  p->nargs -= skip;
+  memmove(p->args, p->args + skip, sizeof(char *) * (p->nargs + 1));
+  return mode;
+}
+
+// A duration like timeout(1) takes: a number of seconds, or of ms, m, h or d
+int parseDuration(char *text, uint64_t *ns) {
+  char *end;
+  double n = strtod(text, &end);
+  double scale = 1e9;
+  if (strcmp(end, "ms") == 0) {
+    scale = 1e6;
+  }
+  else if (strcmp(end, "m") == 0) {
+    scale = 60e9;
+  }
+  else if (strcmp(end, "h") == 0) {
+    scale = 3600e9;
+  }
+  else if (strcmp(end, "d") == 0) {
+    scale = 86400e9;
+  }
+  else if (*end != '\0' && strcmp(end, "s") != 0) {
+    return -1;
+  }
+  if (end == text || !(n >= 0) || n * scale > 1e18) {
+    return -1;
+  }
+  *ns = n * scale;
+  return 0;
+}
+
+/*
+  A line starting with timeout [-k GRACE] DURATION gets a deadline that
+  covers all of it, pipes and background groups included. Anything else
+  starting with timeout is left for a timeout on the path.
+*/
+void stripTimeoutPrefix(Line *l) {
+  l->timeoutNs = 0;
+  l->graceNs = TIMEOUT_GRACE_NS;
+  if (l->npgs <= 0) {
+    return;
+  }
+  Process *p = &l->pgs[0].processes[0];
+  if (p->nargs == 0 || strcmp(p->args[0], "timeout") != 0) {
+    return;
+  }
+
+  int skip = 1;
+  uint64_t grace = l->graceNs;
+  if (p->nargs > 2 && strcmp(p->args[1], "-k") == 0) {
+    if (parseDuration(p->args[2], &grace) != 0) {
+      return;
+    }
+    skip = 3;
+  }
+  uint64_t limit;
+  if (p->nargs <= skip + 1 || parseDuration(p->args[skip], &limit) != 0) {
+    return;
+  }
+  skip++;
+  p->nargs -= skip;
+  memmove(p->args, p->args + skip, sizeof(char *) * (p->nargs + 1));
+  l->timeoutNs = limit;
+  l->graceNs = grace;
+}
+
+/*
+  Lines that ran out of time are reported as they finish, and again all
+  together once a script is done so they aren't lost in its output
+*/
+typedef struct {
+  long number;
+  uint64_t limitNs;
+  int signal;
+  char *command;
+} Overrun;
+
+Overrun *OVERRUNS = NULL;
+int N_OVERRUNS = 0;
+
+void recordOverrun(Line *l) {
+  STATS.timeoutLines++;
+  printError();
+  if (N_OVERRUNS % 16 == 0) {
+    OVERRUNS = realloc(OVERRUNS, sizeof(Overrun) * (N_OVERRUNS + 16));
+  }
+  char command[MAX_PATH];
+  size_t used = 0;
+  for (int i = 0; i < l->npgs && used < sizeof(command); i++) {
+    describeGroup(&l->pgs[i], command + used, sizeof(command) - used);
+    used += strlen(command + used);
+    if (i < l->npgs - 1 && used < sizeof(command)) {
+      used += snprintf(command + used, sizeof(command) - used, " & ");
+    }
+  }
+  Overrun *o = &OVERRUNS[N_OVERRUNS++];
+  o->number = l->number;
+  o->limitNs = l->timeoutNs;
+  o->signal = l->signalled;
+  o->command = strdup(command);
+}
+
+int compareOverruns(const void *a, const void *b) {
+  const Overrun *x = a;
+  const Overrun *y = b;
+  if (x->number != y->number) {
+    return x->number < y->number ? -1 : 1;
+  }
+  return 0;
+}
+
+// wish -j finishes lines out of order, so put them back in script order
+void printOverruns() {
+  if (N_OVERRUNS == 0) {
+    return;
+  }
+  qsort(OVERRUNS, N_OVERRUNS, sizeof(Overrun), compareOverruns);
+  fflush(stdout);
+  fprintf(stderr, "%d line%s ran out of time:\n", N_OVERRUNS, N_OVERRUNS == 1 ? "" : "s");
+  fprintf(stderr, "%8s %10s %-7s %s\n", "line", "limit_s", "signal", "command");
+  for (int i = 0; i < N_OVERRUNS; i++) {
+    Overrun *o = &OVERRUNS[i];
+    fprintf(stderr, "%8ld %10.3f %-7s %s\n", o->number, o->limitNs / 1e9,
+      o->signal == SIGKILL ? "SIGKILL" : "SIGTERM", o->command);
+    free(o->command);
+  }
+  N_OVERRUNS = 0;
+}
+
+double timevalMs(struct timeval *tv) {
+  return tv->tv_sec * 1e3 + tv->tv_usec / 1e3;
+}
+
+// Wall time of a stage; one still stopped counts up to now
+double stageMs(Process *p, struct timespec *now) {
+  if (!p->executed && p->started.tv_sec == 0) {
+    return 0;
+  }
+  return elapsedNs(&p->started, p->reaped || p->pid <= 0 ? &p->ended : now) / 1e6;
+}
+
+void writeJsonString(FILE *f, char *str) {
+  fputc('"', f);
+  for (; *str != '\0'; str++) {
+    if (*str == '"' || *str == '\\') {
+      fprintf(f, "\\%c", *str);
+    }
+    else if ((unsigned char)*str < 0x20) {
+      fprintf(f, "\\u%04x", *str);
+    }
+    else {
+      fputc(*str, f);
+    }
+  }
+  fputc('"', f);
+}
+
+void writeUsage(FILE *f, TimeMode mode, double real, struct rusage *ru) {
+  if (mode == TIME_JSON) {
+    fprintf(f, "\"real_ms\":%.3f,\"user_ms\":%.3f,\"sys_ms\":%.3f,"
+      "\"maxrss_kb\":%ld,\"vcsw\":%ld,\"ivcsw\":%ld,\"minflt\":%ld,\"majflt\":%ld",
+      real, timevalMs(&ru->ru_utime), timevalMs(&ru->ru_stime), ru->ru_maxrss,
+      ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt);
+  }
+  else {
+    fprintf(f, "%10.3f %10.3f %10.3f %10ld %7ld %7ld %8ld %7ld",
+      real, timevalMs(&ru->ru_utime), timevalMs(&ru->ru_stime), ru->ru_maxrss,
+      ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt);
+  }
+}
+
+/*
+  Report a timed line on stderr: one row per process with its wall
+  time and resource usage from wait4(), then totals for the line.
+  Totals add up CPU time, switches and faults; max RSS is the largest
+  of any stage and wall time spans the whole line.
+*/
+void reportTimes(Line *l) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  char *buf;
+  size_t size;
+  FILE *f = open_memstream(&buf, &size);
+  if (l->timed == TIME_JSON) {
+    fprintf(f, "{\"processes\":[");
+  }
+  else {
+    fprintf(f, "%5s %4s %10s %10s %10s %10s %7s %7s %8s %7s %4s %4s  %s\n", "group",
+      "proc", "real(ms)", "user(ms)", "sys(ms)", "maxrss(KB)", "vcsw", "ivcsw",
+      "minflt", "majflt", "cpu", "nice", "command");
+  }
+
+  struct rusage total;
+  memset(&total, 0, sizeof(total));
+  struct timespec *first = NULL;
+  struct timespec *last = NULL;
+  bool any = false;
+  for (int i = 0; i < l->npgs; i++) {
+    for (int j = 0; j < l->pgs[i].nprocesses; j++) {
+      Process *p = &l->pgs[i].processes[j];
+      if (p->nargs == 0) {
+        continue;
+      }
+      struct rusage *ru = &p->rusage;
+      double real = stageMs(p, &now);
+      timeradd(&total.ru_utime, &ru->ru_utime, &total.ru_utime);
+      timeradd(&total.ru_stime, &ru->ru_stime, &total.ru_stime);
+      total.ru_maxrss = ru->ru_maxrss > total.ru_maxrss ? ru->ru_maxrss : total.ru_maxrss;
+      total.ru_nvcsw += ru->ru_nvcsw;
+      total.ru_nivcsw += ru->ru_nivcsw;
+      total.ru_minflt += ru->ru_minflt;
+      total.ru_majflt += ru->ru_majflt;
+      if (p->started.tv_sec != 0) {
+        struct timespec *ended = p->reaped || p->pid <= 0 ? &p->ended : &now;
+        first = first == NULL || elapsedNs(&p->started, first) > 0 ? &p->started : first;
+        last = last == NULL || elapsedNs(last, ended) > 0 ? ended : last;
       }
-      else if (p->nargs == 0) {
-        logPrint("Error: No command before redirection\n");
-        printError();
-        return -1;
+
+      char command[MAX_PATH];
+      ProcessGroup one = {.nprocesses = 1, .processes = p};
+      describeGroup(&one, command, sizeof(command));
+      if (l->timed == TIME_JSON) {
+        fprintf(f, "%s{\"group\":%d,\"process\":%d,\"command\":", any ? "," : "", i, j);
+        writeJsonString(f, command);
+        fprintf(f, ",\"pid\":%d,\"status\":%d,", p->pid > 0 ? p->pid : 0,
+          WIFSIGNALED(p->status) ? 128 + WTERMSIG(p->status) : WEXITSTATUS(p->status));
+        writeUsage(f, l->timed, real, ru);
+        if (p->cpu >= 0) {
+          fprintf(f, ",\"cpu\":%d", p->cpu);
+        }
+        if (demoted(&l->pgs[i])) {
+          fprintf(f, ",\"nice\":%d,\"batch\":%s", PLACEMENT.nice,
+            PLACEMENT.batch ? "true" : "false");
+        }
+        fprintf(f, "}");
       }
-      *s = RFOUT;
-      break;
-    case 0:
-      if ((*s == RFIN && p->rfin == NULL) || (*s == RFOUT && p->rfout == NULL)) {
-        logPrint("Error: No redirection file specified\n");
-        printError();
-        return -1;
+      else {
+        fprintf(f, "%5d %4d ", i, j);
+        writeUsage(f, l->timed, real, ru);
+        char cpu[16] = "-";
+        char nice[16] = "-";
+        if (p->cpu >= 0) {
+          snprintf(cpu, sizeof(cpu), "%d", p->cpu);
+        }
+        if (demoted(&l->pgs[i])) {
+          snprintf(nice, sizeof(nice), "%d%s", PLACEMENT.nice, PLACEMENT.batch ? "b" : "");
+        }
+        fprintf(f, " %4s %4s  %s\n", cpu, nice, command);
       }
-      *s = END;
-      break;
-    default:
-      logPrint("Encountered unknown deliminater: %c\n", delim);
-      exit(1);
+      any = true;
+    }
+  }
+
+  double real = first == NULL ? 0 : elapsedNs(first, last) / 1e6;
+  if (l->timed == TIME_JSON) {
+    fprintf(f, "],\"total\":{");
+    writeUsage(f, l->timed, real, &total);
+    fprintf(f, "}}\n");
+  }
+  else {
+    fprintf(f, "%-10s ", "total");
+    writeUsage(f, l->timed, real, &total);
+    fprintf(f, "\n");
   }
-  return 0;
-}
 
-int parseProcess(Process *p, char *s){
-  int maxArgs = 5;
-  p->args = malloc(sizeof(*(p->args)) * maxArgs);
-  char *cmdToken;
-  char *delim = " <>";
-  char *copy = strdup(s);
+  fclose(f);
+  if (write(STDERR_FILENO, buf, size) < 0) {
+    logPrint("Failed to write time report\n");
+  }
+  free(buf);
+}
 
-  cmdToken = strtok(s, delim);
-  state currState = ARGUMENT;
-  while (cmdToken != NULL) {
-    if (saveToken(p, cmdToken, currState) != 0){
-      logPrint("Save token failed\n");
+// An anonymous, sealed file holding body, positioned at its start
+int makeHereFd(const char *body, size_t len) {
+  int fd = memfd_create("wish-here", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return -1;
+  }
+  for (size_t done = 0; done < len; ) {
+    ssize_t n = write(fd, body + done, len - done);
+    if (n < 0 && errno != EINTR) {
+      close(fd);
       return -1;
     }
-    char currdelim = copy[cmdToken-s+strlen(cmdToken)];
-    logPrint("token=%s, delim=%c\n", cmdToken, currdelim);
-    if (changeState(&currState, currdelim, p) != 0){
-      return -1;
+    done += n > 0 ? n : 0;
+  }
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+/*
+  Give each here-document and here-string on the line its memfd. The
+  bodies of here-documents are the lines that follow, in the order
+  their << appear, each ending at a line that is just its delimiter.
+*/
+int readHereBodies(Line *l) {
+  char *body = NULL;
+  size_t cap = 0;
+  int rc = 0;
+  for (int i = 0; i < l->npgs; i++) {
+    for (int j = 0; j < l->pgs[i].nprocesses; j++) {
+      Process *p = &l->pgs[i].processes[j];
+      if (p->here == NULL) {
+        continue;
+      }
+
+      size_t size = 0;
+      size_t delimLen = strlen(p->here);
+      if (p->hereString) {
+        size = delimLen + 1;
+        body = size > cap ? realloc(body, cap = size) : body;
+        memcpy(body, p->here, delimLen);
+        body[delimLen] = '\n';
+      }
+      else {
+        while (1) {
+          char *text;
+          size_t len;
+          if (INTERACTIVE) {
+            printf("> ");
+            fflush(stdout);
+          }
+          if (LINE_INPUT == NULL || readLine(LINE_INPUT, &text, &len) != 0) {
+            logPrint("Here-document ended by EOF instead of %s\n", p->here);
+            break;
+          }
+          if (len == delimLen && memcmp(text, p->here, len) == 0) {
+            break;
+          }
+          if (size + len + 1 > cap) {
+            cap = (size + len + 1) * 2;
+            body = realloc(body, cap);
+          }
+          memcpy(body + size, text, len);
+          body[size + len] = '\n';
+          size += len + 1;
+        }
+      }
+
+      if (rc == 0 && (p->hereFd = makeHereFd(body, size)) < 0) {
+        logPrint("Failed to create memfd: %s\n", strerror(errno));
+        printError();
+        rc = -1;
+      }
     }
-    cmdToken = strtok(NULL, delim);
+  }
+  free(body);
+  return rc;
+}
 
-    // Resize if all malloc'd arg space has been used up
-    if (p->nargs == maxArgs) {
-      maxArgs *= 2;
-      p->args = realloc(p->args, sizeof(*(p->args)) * maxArgs);
-      logPrint("Doubled maxArgs: %d\n", maxArgs);
+void closeHereFds(Line *l) {
+  for (int i = 0; i < l->npgs; i++) {
+    for (int j = 0; j < l->pgs[i].nprocesses; j++) {
+      if (l->pgs[i].processes[j].hereFd >= 0) {
+        close(l->pgs[i].processes[j].hereFd);
+      }
     }
   }
+}
 
-  // Final resize to number of args 
-  // (+ 1 to add ending NULL pointer for execv)
-  p->args = realloc(p->args, sizeof(char*) * (p->nargs + 1));
-  p->args[p->nargs] = NULL;
+/*
+  memo caches the output of a deterministic command. A line starting
+  with memo is keyed by a 128-bit FNV-1a hash of the command's binary
+  (its path, inode, size and mtime) or builtin name, its arguments, the
+  contents of its input redirect or here-document, and the working
+  directory. On a hit the cached output is copied to where the command's
+  output would have gone and nothing runs. On a miss the command runs as
+  usual with its output going to a file in the cache, which is copied
+  on once it finishes and kept if it exited 0.
 
-  return 0;
+  Entries are files named by their key in WISH_MEMO_DIR (by default
+  ~/.cache/wish/memo). A hit touches its entry, and once the entries add
+  up to more than WISH_MEMO_SIZE bytes the least recently used are
+  removed until they fit in three quarters of it.
+*/
+#define MEMO_DEFAULT_SIZE (256ULL << 20)
+
+typedef unsigned __int128 Hash128;
+
+typedef struct {
+  char *dir;
+  unsigned long long limit;
+  // What the entries add up to, or -1 until the directory is scanned
+  long long size;
+  unsigned long temps;
+} MemoCache;
+
+MemoCache MEMO = {NULL, 0, -1, 0};
+
+Hash128 fnv128(const void *data, size_t len, Hash128 h) {
+  const Hash128 prime = (Hash128)1 << 88 | 0x13b;
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ bytes[i]) * prime;
+  }
+  return h;
+}
+
+/*
+  File contents are folded in eight bytes per multiply rather than one,
+  which is what keeps hashing a large input well under the cost of
+  running the command again
+*/
+Hash128 fnv128Words(const void *data, size_t len, Hash128 h) {
+  const Hash128 prime = (Hash128)1 << 88 | 0x13b;
+  const unsigned char *bytes = data;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    h = (h ^ word) * prime;
+  }
+  return fnv128(bytes + i, len - i, h);
+}
+
+// Strings go in with their NUL, so fields can't run into each other
+Hash128 fnv128String(char *s, Hash128 h) {
+  return fnv128(s, strlen(s) + 1, h);
 }
 
-int parseGroup(ProcessGroup *pg, char *s) {
-  int maxProcesses = 1;
-  pg->processes = malloc(sizeof(*(pg->processes)) * maxProcesses);
-  Process *processPtrs = pg->processes;
+Hash128 fnv128File(int fd, Hash128 h) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return h;
+  }
+  h = fnv128(&st.st_size, sizeof(st.st_size), h);
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      h = fnv128Words(map, st.st_size, h);
+      munmap(map, st.st_size);
+    }
+  }
+  return h;
+}
 
-  char *processToken;
-  char *delim = "|";
+int makeDirs(char *path) {
+  char dir[MAX_PATH];
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST) {
+      return -1;
+    }
+    *slash = '/';
+  }
+  return mkdir(dir, S_IRWXU) != 0 && errno != EEXIST ? -1 : 0;
+}
 
-  processToken = strsep(&s, delim);
+int initMemo() {
+  if (MEMO.dir != NULL) {
+    return 0;
+  }
+  char dir[MAX_PATH];
+  char *env = getenv("WISH_MEMO_DIR");
+  if (env != NULL && *env != '\0') {
+    snprintf(dir, sizeof(dir), "%s", env);
+  }
+  else if (getenv("XDG_CACHE_HOME") != NULL && *getenv("XDG_CACHE_HOME") != '\0') {
+    snprintf(dir, sizeof(dir), "%s/wish/memo", getenv("XDG_CACHE_HOME"));
+  }
+  else if (getenv("HOME") != NULL) {
+    snprintf(dir, sizeof(dir), "%s/.cache/wish/memo", getenv("HOME"));
+  }
+  else {
+    return -1;
+  }
+  if (makeDirs(dir) != 0) {
+    logPrint("Cannot create memo directory %s: %s\n", dir, strerror(errno));
+    return -1;
+  }
 
-  while (processToken != NULL) {
-    // Resize if all of the malloc'd space has been used up
-    if (pg->nprocesses == maxProcesses) {
-      maxProcesses *= 2;
-      pg->processes = realloc(pg->processes, sizeof(*(pg->processes)) * maxProcesses);
-      processPtrs = pg->processes;
-      logPrint("Doubled number of Processes: %d\n", maxProcesses);
+  MEMO.limit = MEMO_DEFAULT_SIZE;
+  char *size = getenv("WISH_MEMO_SIZE");
+  if (size != NULL && *size != '\0') {
+    char *end;
+    unsigned long long limit = strtoull(size, &end, 10);
+    switch (*end) {
+      case 'k': case 'K': limit <<= 10; break;
+      case 'm': case 'M': limit <<= 20; break;
+      case 'g': case 'G': limit <<= 30; break;
     }
+    MEMO.limit = limit;
+  }
+  MEMO.dir = strdup(dir);
+  return 0;
+}
+
+/*
+  A line starting with memo has the prefix dropped, like time. Only a
+  single foreground command can be memoised, and of the builtins only
+  those that leave the shell alone, since a replay doesn't run them.
+*/
+bool stripMemoPrefix(Line *l) {
+  if (l->npgs <= 0) {
+    return false;
+  }
+  Process *p = &l->pgs[0].processes[0];
+  if (p->nargs == 0 || strcmp(p->args[0], "memo") != 0) {
+    return false;
+  }
+  p->nargs--;
+  memmove(p->args, p->args + 1, sizeof(char *) * (p->nargs + 1));
+  if (p->nargs == 0 || l->npgs > 1 || l->pgs[0].nprocesses > 1 || l->pgs[0].background) {
+    logPrint("memo takes a single foreground command\n");
+    printError();
+    closeHereFds(l);
+    l->npgs = -1;
+  }
+  else if (isBuiltIn(p) && !inList(p->args[0], PURE_BUILTINS)) {
+    logPrint("memo can't replay the builtin %s\n", p->args[0]);
+    printError();
+    closeHereFds(l);
+    l->npgs = -1;
+  }
+  return true;
+}
 
-    logPrint("%s\n", processToken);
+/*
+  Work out p's key. Returns -1 for a command that can't be keyed (one
+  not on the path, or whose input can't be opened), which then just
+  runs and fails as it would have without memo.
+*/
+int memoKey(Process *p, char *key) {
+  Hash128 h = fnv128String("wish memo 1", (Hash128)0x6c62272e07bb0142ULL << 64 | 0x62b821756295c58dULL);
 
-    initializeProcess(&(processPtrs[pg->nprocesses]), pg->nprocesses);
-    if (
-      parseProcess(&processPtrs[pg->nprocesses], processToken) != 0) {
-      logPrint("parseProcess failed\n");
+  if (isBuiltIn(p)) {
+    h = fnv128String("builtin", h);
+    h = fnv128String(p->args[0], h);
+  }
+  else {
+    HashEntry *e = prefetchCommand(p->args[0]);
+    struct stat st;
+    if (e->path == NULL || stat(e->path, &st) != 0) {
       return -1;
     }
-    pg->nprocesses++;
+    h = fnv128String(e->path, h);
+    h = fnv128(&st.st_dev, sizeof(st.st_dev), h);
+    h = fnv128(&st.st_ino, sizeof(st.st_ino), h);
+    h = fnv128(&st.st_size, sizeof(st.st_size), h);
+    h = fnv128(&st.st_mtim, sizeof(st.st_mtim), h);
+  }
 
-    processToken = strsep(&s, delim);
+  for (int i = 0; i < p->nargs; i++) {
+    h = fnv128String(p->args[i], h);
   }
 
-  // Final resize
-  pg->processes = realloc(pg->processes, sizeof(*(pg->processes)) * pg->nprocesses);
+  char cwd[MAX_PATH];
+  h = fnv128String(getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "", h);
+
+  if (p->hereFd >= 0) {
+    h = fnv128String("here", h);
+    h = fnv128File(p->hereFd, h);
+  }
+  else if (p->rfin != NULL) {
+    int fd = open(p->rfin, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return -1;
+    }
+    h = fnv128String("input", h);
+    h = fnv128File(fd, h);
+    close(fd);
+  }
 
+  snprintf(key, 33, "%016llx%016llx", (unsigned long long)(h >> 64), (unsigned long long)h);
   return 0;
 }
 
-int parseLine(ProcessGroup **pgsPtr, char *line){
-  // **pgsPtr is a pointer to an array of ProcessGroups
-
-  if (preprocessLine(&line) == NULL) {
-    logPrint("preprocessLine failed\n");
-    return -1;
+int openMemoDest(Memo *m) {
+  if (m->dest == NULL) {
+    fflush(stdout);
+    return STDOUT_FILENO;
   }
-  if (strlen(line) == 0){
-    return 0;
+  int fd = open(m->dest, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, S_IRWXU);
+  if (fd < 0) {
+    logPrint("Failed to open file for output: %s\n", m->dest);
+    printError();
   }
-  logPrint("Line after preprocessesing: %s\n", line);
-  char* copy = strdup(line);
-
-  int maxPgs = 1;
-  *pgsPtr = malloc(sizeof(**pgsPtr) * maxPgs);
-  ProcessGroup *pgs = *pgsPtr;
-  int ngroups = 0;
+  return fd;
+}
 
-  char *groupToken;
-  char *delim = "&";
+typedef struct {
+  char name[33];
+  struct timespec mtime;
+  off_t size;
+} MemoEntry;
 
-  groupToken = strsep(&line, delim);
+int compareMemoEntries(const void *a, const void *b) {
+  const MemoEntry *x = a;
+  const MemoEntry *y = b;
+  if (x->mtime.tv_sec != y->mtime.tv_sec) {
+    return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  }
+  return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : x->mtime.tv_nsec > y->mtime.tv_nsec;
+}
 
-  while (groupToken != NULL) {
-    if (ngroups == maxPgs) {
-      maxPgs *= 2;
-      *pgsPtr = realloc(*pgsPtr, sizeof(**pgsPtr) * maxPgs);
-      pgs = *pgsPtr;
-      logPrint("Doubled number of ProcessGroups: %d\n", maxPgs);
+/*
+  Total up the entries, and if they are over the limit remove the
+  oldest. Other shells may share the directory, so the total is only
+  trusted between scans.
+*/
+void evictMemo() {
+  DIR *dir = opendir(MEMO.dir);
+  if (dir == NULL) {
+    return;
+  }
+  MemoEntry *entries = NULL;
+  size_t count = 0;
+  size_t cap = 0;
+  long long size = 0;
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL) {
+    struct stat st;
+    if (strlen(d->d_name) != 32 || fstatat(dirfd(dir), d->d_name, &st, 0) != 0) {
+      continue;
+    }
+    if (count == cap) {
+      cap = cap == 0 ? 64 : cap * 2;
+      entries = realloc(entries, sizeof(*entries) * cap);
     }
+    memcpy(entries[count].name, d->d_name, 33);
+    entries[count].mtime = st.st_mtim;
+    entries[count].size = st.st_size;
+    size += st.st_size;
+    count++;
+  }
 
-    logPrint("%s\n", groupToken);
-    initializeProcessGroup(&(pgs[ngroups]), ngroups);
-    if (parseGroup(&(pgs[ngroups]), groupToken) != 0) {
-      logPrint("parseGroup failed\n");
-      return -1;
+  if ((unsigned long long)size > MEMO.limit) {
+    qsort(entries, count, sizeof(*entries), compareMemoEntries);
+    for (size_t i = 0; i < count && (unsigned long long)size > MEMO.limit / 4 * 3; i++) {
+      if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+        size -= entries[i].size;
+        STATS.memoEvicted++;
+      }
     }
-    ngroups++;
-    groupToken = strsep(&line, delim);
+    logPrint("Memo cache down to %lld bytes\n", size);
   }
+  closedir(dir);
+  free(entries);
+  MEMO.size = size;
+}
 
-  // Don't put the last group in the background unless specified
-  if (copy[strlen(copy)-1] != '&') {
-    logPrint("number of groups: %d\n", ngroups);
-    pgs[ngroups-1].background = false;
+/*
+  Look l's command up before it runs. On a hit its output is replayed
+  and true is returned; on a miss its output is pointed at a new file
+  in the cache for storeMemo() to deal with once it has run.
+*/
+bool replayMemo(Line *l) {
+  Memo *m = &l->memo;
+  Process *p = &l->pgs[0].processes[0];
+  m->dest = p->rfout;
+  m->temp[0] = '\0';
+  if (initMemo() != 0 || memoKey(p, m->key) != 0) {
+    return false;
   }
 
-  // Final resize
-  *pgsPtr = realloc(*pgsPtr, sizeof(**pgsPtr) * ngroups);
+  char entry[MAX_PATH];
+  snprintf(entry, sizeof(entry), "%s/%s", MEMO.dir, m->key);
+  int fd = open(entry, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    logPrint("Memo hit %s\n", m->key);
+    STATS.memoHits++;
+    // Touching it on every hit is what makes the eviction LRU
+    futimens(fd, NULL);
+    int out = openMemoDest(m);
+    if (out >= 0) {
+      ssize_t n = copyFd(fd, out);
+      STATS.memoReplayedBytes += n > 0 ? n : 0;
+      if (out != STDOUT_FILENO) {
+        close(out);
+      }
+    }
+    close(fd);
+    m->hit = true;
+    return true;
+  }
 
-  return ngroups;
-} 
+  logPrint("Memo miss %s\n", m->key);
+  STATS.memoMisses++;
+  snprintf(m->temp, sizeof(m->temp), "%s/.%d.%lu", MEMO.dir, getpid(), MEMO.temps++);
+  p->rfout = m->temp;
+  return false;
+}
 
-int path(int nargs, char** args) {
-  // TODO: might need to check if path given exists?
-  if (nargs == 1){
-    memset(SEARCH_PATH, 0, sizeof(char) * strlen(SEARCH_PATH));
+// Pass on the output of a command that missed, and keep it if it worked
+void storeMemo(Line *l) {
+  Memo *m = &l->memo;
+  Process *p = &l->pgs[0].processes[0];
+  if (m->temp[0] == '\0') {
+    return;
+  }
+  int fd = open(m->temp, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  int out = openMemoDest(m);
+  if (out >= 0) {
+    copyFd(fd, out);
+    if (out != STDOUT_FILENO) {
+      close(out);
+    }
+  }
+
+  struct stat st;
+  char entry[MAX_PATH];
+  snprintf(entry, sizeof(entry), "%s/%s", MEMO.dir, m->key);
+  // Builtins run in the shell aren't marked executed, but have a start
+  bool ran = p->executed || p->started.tv_sec != 0;
+  bool ok = ran && (p->pid <= 0 || p->reaped) && p->status == 0;
+  if (ok && fstat(fd, &st) == 0 && rename(m->temp, entry) == 0) {
+    STATS.memoStored++;
+    if (MEMO.size < 0 || (unsigned long long)(MEMO.size += st.st_size) > MEMO.limit) {
+      evictMemo();
+    }
   }
   else {
-    size_t allocSize = MAX_PATH;
-    char* buf = (char *)malloc(allocSize);
-    char* fullPath = getcwd(buf, allocSize);
-    strcat(fullPath, "/");
-    for (int i = 1; i < nargs; i++){
-      char c = args[i][0];
-      strcat(SEARCH_PATH, ";");
-      if (c != '/' && c != '~' && !(c=='.'&&args[i][1]=='/')){
-        strcat(SEARCH_PATH, fullPath);
+    unlink(m->temp);
+  }
+  close(fd);
+  p->rfout = m->dest;
+}
+
+/*
+  Parse text into l. When ahead is set, the line is being parsed while
+  the previous line's children are still running, so anything it would
+  print is held back until showLine() and its commands are resolved on
+  the path now so that launching it later is only a hash hit.
+*/
+void parseInto(Line *l, char *text, size_t len, bool ahead) {
+  l->echo = NULL;
+  l->errors = 0;
+  DEFER_TO = ahead ? l : NULL;
+  l->number = LINE_INPUT != NULL ? LINE_INPUT->lines : 0;
+  l->signalled = 0;
+  uint64_t start = traceStart();
+  l->npgs = planLine(&l->arena, &l->pgs, text, len);
+  if (l->npgs > 0 && readHereBodies(l) != 0) {
+    closeHereFds(l);
+    l->npgs = -1;
+  }
+  traceEnd(TRACE_PARSE, start, len);
+  l->timed = stripTimePrefix(l);
+  stripTimeoutPrefix(l);
+  l->memo.on = stripMemoPrefix(l);
+  l->memo.hit = false;
+  DEFER_TO = NULL;
+
+  if (ahead) {
+    for (int i = 0; i < l->npgs; i++) {
+      for (int j = 0; j < l->pgs[i].nprocesses; j++) {
+        Process *p = &l->pgs[i].processes[j];
+        if (p->nargs > 0 && !isBuiltIn(p)) {
+          prefetchCommand(p->args[0]);
+        }
       }
-      strcat(SEARCH_PATH, args[i]);
     }
-    logPrint("New SEARCH_PATH: %s\n", SEARCH_PATH);
-    free(buf);
   }
-  return 0;
 }
 
-int cd(int nargs, char **args) {
-  if (nargs != 2) {
-    logPrint("Wrong number of args for cd (given %d)\n", nargs);
+void showLine(Line *l) {
+  if (l->echo != NULL) {
+    printf("%s\n", l->echo);
+  }
+  for (; l->errors > 0; l->errors--) {
     printError();
-    return -1;
   }
-  size_t allocSize = sizeof(char) * 1024;
-  char* buf = (char *)malloc(allocSize);
-  char* path = getcwd(buf, allocSize);
-  strcat(path, "/");
-  strcat(path, args[1]);
-  if (access(path, F_OK) == 0) {
-    chdir(path);
+}
+
+void launch(Line *l) {
+  if (l->npgs < 0) {
+    logPrint("parseLine failed\n");
+  }
+  else if (l->npgs == 0) {
+    // If there are no processes, don't run anything
+    logPrint("No processes to execute\n");
+  }
+  else if (l->memo.on && replayMemo(l)) {
+    logPrint("Output replayed from the memo cache\n");
   }
   else {
-    logPrint("Path for cd is not accessible: %s\n", path);
-    free(buf);
-    return -1;
+    armDeadline(l);
+    bool detached = DETACHED_LAUNCH;
+    DETACHED_LAUNCH = detached || l->deadline != 0;
+    launchLine(l->npgs, l->pgs);
+    DETACHED_LAUNCH = detached;
   }
-  free(buf);
-  return 0;
-}
 
-int cat(int nargs, char **args) {
-  FILE* f;
-  char s[MAX_PATH];
+  // An interactive line ending in & doesn't hold up the prompt
+  l->async = INTERACTIVE && l->npgs > 0 && l->pgs[l->npgs-1].background;
+  if (l->async) {
+    for (int i = 0; i < l->npgs; i++) {
+      ProcessGroup *pg = &l->pgs[i];
+      if (pg->running == 0) {
+        continue;
+      }
+      Job *job = makeJob(pg, false);
+      Process *last = &pg->processes[pg->nprocesses-1];
+      printf("[%d] %d\n", job->id, pg->pgid > 0 ? pg->pgid : last->pid);
+    }
+  }
+}
 
-  if (nargs == 1) {
-    // Iterate over each line in stdin and print to STDOUT
-    while(fgets(s, MAX_PATH, stdin)){
-      printf("%s", s);
+void finish(Line *l) {
+  if (l->npgs > 0 && !l->async) {
+    if (!l->memo.hit) {
+      waitGroups(l->npgs, l->pgs);
+    }
+    if (l->signalled != 0) {
+      recordOverrun(l);
+    }
+    if (l->memo.on && !l->memo.hit) {
+      storeMemo(l);
+    }
+    if (l->timed != TIME_OFF) {
+      reportTimes(l);
     }
-    return 0;
   }
+  // A line left running as a job is no longer timed
+  disarmDeadline(l);
+  // Everything parsed from the line lives in its arena and is
+  // released in one go once the line has run
+  closeHereFds(l);
+  arenaReset(&l->arena);
+}
 
-  // Iterate over each file in command
-  // Start at 1 since the first arg is the name of the program
-  // If no arguments were given, this loop will not execute and nothing will be printed
-  for (int i = 1; i < nargs; i++){
+void eval(char *text, size_t len){
+  static Line line;
 
-    // open file in read mode
-    f = fopen(args[i], "r");
+  // Parse line into ProcessGroups and Processes
+  // Each ProcessGroup is run in the background together (or not)
+  parseInto(&line, text, len, false);
+  launch(&line);
+  finish(&line);
+}
 
-    // If f is NULL, the file does not exist
-    if (f == NULL){
-      printError();
-      return -1;
+/*
+  Run a batch script one line behind the reader: while line N's
+  children run, line N+1 is read and parsed, and only then does the
+  shell wait for line N.
+*/
+void runBatch(Input *in) {
+  static Line lines[2];
+  Line *curr = &lines[0];
+  Line *next = &lines[1];
+  char *text;
+  size_t len;
+
+  LINE_INPUT = in;
+  if (readLine(in, &text, &len) != 0) {
+    return;
+  }
+  parseInto(curr, text, len, false);
+
+  while (1) {
+    launch(curr);
+
+    // Builtin threads may be reading history or printing errors, so
+    // don't parse the next line under them. Nor a line with globs,
+    // which has to see the files this one creates.
+    bool more = readLine(in, &text, &len) == 0;
+    bool waited = N_THREADS > 0 || (more && hasGlobChars(text, len));
+    if (waited) {
+      finish(curr);
+    }
+    if (more) {
+      parseInto(next, text, len, !waited);
+    }
+    if (!waited) {
+      finish(curr);
+    }
+    if (!more) {
+      break;
     }
 
-    // Iterate over each line in the file and print to STDOUT
-    while(fgets(s, MAX_PATH, f)){
-      printf("%s", s);
+    showLine(next);
+    Line *tmp = curr;
+    curr = next;
+    next = tmp;
+  }
+  printOverruns();
+}
+
+/*
+  wish -j N runs a batch script's lines out of order where their files
+  allow it, N lines at a time. Lines are read and parsed up to a window
+  ahead of the oldest one not yet finished, and each gets a dependency
+  on every earlier line whose files conflict with its own:
+
+  - a < file is read, a > file is written;
+  - arguments are taken as files read, except for the commands that
+    exist to change files (rm, mv, cp, touch and so on), whose
+    arguments are written;
+  - anything under a path counts as using the directories above it.
+
+  A line waits for the last writer of whatever it reads, and a writer
+  also waits for the readers since. Lines whose parse or run depends on
+  the shell itself (any other builtin, and globs, which are expanded
+  against the files earlier lines make) are barriers: everything before
+  them finishes first and nothing after them is parsed until they have
+  run.
+
+  Everything a line prints, from parsing through to finishing, goes to
+  a pair of memfds in place of the shell's stdout and stderr, and they
+  are copied out in line order, so the output is what a plain run gives.
+*/
+typedef enum {
+  DAG_WAITING,
+  DAG_RUNNING,
+  DAG_DONE,
+} DagState;
+
+typedef struct {
+  Line line;
+  long seq;
+  DagState state;
+  bool barrier;
+  int out;
+  int err;
+  long *deps;
+  int ndeps;
+  int maxDeps;
+} DagLine;
+
+// The last line to write a path, and the lines that read it since
+typedef struct {
+  char *path;
+  long writer;
+  long *readers;
+  int nreaders;
+  int maxReaders;
+} DagPath;
+
+typedef struct {
+  int slots;
+  DagLine *window;
+  int size;
+  // Lines up to shown have been written out, those up to parsed are in the window
+  long shown;
+  long parsed;
+  int running;
+  int realOut;
+  int realErr;
+  DagPath *paths;
+  size_t npaths;
+  size_t maxPaths;
+  char cwd[MAX_PATH];
+} Dag;
+
+Dag DAG;
+
+char *DAG_WRITERS[] = {"rm", "mv", "cp", "ln", "touch", "mkdir", "rmdir", "chmod", "chown",
+  "truncate", "tee", "install", "dd", NULL};
+
+// Send stdout and stderr to d's memfds, or back where they were with NULL
+void captureOutput(DagLine *d) {
+  fflush(stdout);
+  dup2(d != NULL ? d->out : DAG.realOut, STDOUT_FILENO);
+  dup2(d != NULL ? d->err : DAG.realErr, STDERR_FILENO);
+}
+
+DagPath *findDagPath(char *path) {
+  if ((DAG.npaths + 1) * 2 > DAG.maxPaths) {
+    DagPath *old = DAG.paths;
+    size_t oldSize = DAG.maxPaths;
+    DAG.maxPaths = oldSize == 0 ? 256 : oldSize * 2;
+    DAG.paths = calloc(DAG.maxPaths, sizeof(DagPath));
+    for (size_t i = 0; i < oldSize; i++) {
+      if (old[i].path != NULL) {
+        size_t j = hashString(old[i].path) & (DAG.maxPaths - 1);
+        while (DAG.paths[j].path != NULL) {
+          j = (j + 1) & (DAG.maxPaths - 1);
+        }
+        DAG.paths[j] = old[i];
+      }
     }
+    free(old);
+  }
 
-    // Close file to prevent memory leaks
-    fclose(f);
+  size_t i = hashString(path) & (DAG.maxPaths - 1);
+  for (; DAG.paths[i].path != NULL; i = (i + 1) & (DAG.maxPaths - 1)) {
+    if (strcmp(DAG.paths[i].path, path) == 0) {
+      return &DAG.paths[i];
+    }
   }
-
-  return 0;
+  DAG.npaths++;
+  DAG.paths[i].path = strdup(path);
+  DAG.paths[i].writer = -1;
+  return &DAG.paths[i];
 }
 
-int history(int nargs, char **args) {
-  if (nargs != 1) {
-    logPrint("Incorrect number of args for history\n");
-    printError();
-    return -1;
+// Every earlier line has finished at a barrier, so what they used is forgotten
+void clearDagPaths() {
+  for (size_t i = 0; i < DAG.maxPaths; i++) {
+    free(DAG.paths[i].path);
+    free(DAG.paths[i].readers);
   }
+  memset(DAG.paths, 0, sizeof(DagPath) * DAG.maxPaths);
+  DAG.npaths = 0;
+}
 
-  for (int i = 0; i < N_HISTORY_ENTRIES; i++) {
-    printf("%5.i %s\n", i+1, HISTORY[i]);
+void addDep(DagLine *d, long seq) {
+  if (seq < DAG.shown || seq >= d->seq || (d->ndeps > 0 && d->deps[d->ndeps - 1] == seq)) {
+    return;
   }
-  return 0;
+  if (d->ndeps == d->maxDeps) {
+    d->maxDeps = d->maxDeps == 0 ? 8 : d->maxDeps * 2;
+    d->deps = realloc(d->deps, sizeof(long) * d->maxDeps);
+  }
+  d->deps[d->ndeps++] = seq;
 }
 
-int tryBuiltIn(Process *p) {
-  logPrint("Trying builtin for %s\n", p->args[0]);
-  char * cmd = p->args[0];
-
-  if (strcmp(cmd, "exit") == 0) {
-    if (p->nargs > 1) {
-      logPrint("Wrong number of args for exit (given %d, expected 1)\n", p->nargs);
-      printError();
-      return -1;
-    }
-    exit(0);
+void usePath(DagLine *d, char *path, bool write) {
+  DagPath *p = findDagPath(path);
+  if (p->writer >= 0) {
+    addDep(d, p->writer);
   }
-  else if (strcmp(cmd, "path") == 0){
-    return path(p->nargs, p->args);
+  if (!write) {
+    if (p->nreaders == p->maxReaders) {
+      p->maxReaders = p->maxReaders == 0 ? 4 : p->maxReaders * 2;
+      p->readers = realloc(p->readers, sizeof(long) * p->maxReaders);
+    }
+    p->readers[p->nreaders++] = d->seq;
+    return;
   }
-  else if (strcmp(cmd, "showpath") == 0) {
-    fprintf(stdout, "%s\n", SEARCH_PATH);
-    return 0;
+  for (int i = 0; i < p->nreaders; i++) {
+    addDep(d, p->readers[i]);
   }
-  else if (strcmp(cmd, "cd") == 0) {
-    return cd(p->nargs, p->args);
+  p->nreaders = 0;
+  p->writer = d->seq;
+}
+
+/*
+  Record that d reads or writes file, which is made absolute and has
+  its . and .. components resolved without looking at the filesystem
+*/
+void useFile(DagLine *d, char *file, bool write) {
+  char path[MAX_PATH];
+  size_t len = 0;
+  if (file[0] != '/') {
+    len = snprintf(path, sizeof(path), "%s", DAG.cwd);
   }
-  else if (strcmp(cmd, "cat") == 0) {
-    return cat(p->nargs, p->args);
+  for (char *part = file; *part != '\0'; ) {
+    char *end = strchrnul(part, '/');
+    size_t n = end - part;
+    if (n == 2 && part[0] == '.' && part[1] == '.') {
+      while (len > 0 && path[--len] != '/') {
+      }
+    }
+    else if (n > 0 && !(n == 1 && part[0] == '.') && len + n + 2 < sizeof(path)) {
+      path[len++] = '/';
+      memcpy(path + len, part, n);
+      len += n;
+    }
+    part = *end == '/' ? end + 1 : end;
   }
-  else if (strcmp(cmd, "history") == 0) {
-    return history(p->nargs, p->args);
+  path[len] = '\0';
+  if (len == 0 || strncmp(path, "/dev/", 5) == 0 || strncmp(path, "/proc/", 6) == 0) {
+    return;
   }
 
-  return 1;
+  usePath(d, path, write);
+  // The directories above it are read
+  for (char *slash = strrchr(path, '/'); slash != NULL && slash > path; slash = strrchr(path, '/')) {
+    *slash = '\0';
+    usePath(d, path, false);
+  }
 }
 
-int findOnPath(char *dest, char *tail) {
-  char *searchpathcpy = strdup(SEARCH_PATH);
-  char *delim = ";";
-  char *token;
-
-  token = strtok(searchpathcpy, delim);
+// Work out what d depends on, or that it is a barrier
+void addDagLine(DagLine *d) {
+  Line *l = &d->line;
+  d->ndeps = 0;
+  d->barrier = false;
+  for (int i = 0; i < l->npgs && !d->barrier; i++) {
+    for (int j = 0; j < l->pgs[i].nprocesses; j++) {
+      Process *p = &l->pgs[i].processes[j];
+      if (p->nargs > 0 && isBuiltIn(p) && !inList(p->args[0], PURE_BUILTINS)) {
+        d->barrier = true;
+        break;
+      }
+    }
+  }
+  if (d->barrier) {
+    return;
+  }
 
-  while (token != NULL) {
-    dest = strcpy(dest, token);
-    dest = strcat(dest, "/");
-    dest = strcat(dest, tail);
-    if (access(dest, X_OK) == 0) {
-      return 0;
+  for (int i = 0; i < l->npgs; i++) {
+    for (int j = 0; j < l->pgs[i].nprocesses; j++) {
+      Process *p = &l->pgs[i].processes[j];
+      if (p->nargs == 0) {
+        continue;
+      }
+      char *slash = strrchr(p->args[0], '/');
+      bool writer = !isBuiltIn(p) && inList(slash != NULL ? slash + 1 : p->args[0], DAG_WRITERS);
+      if (slash != NULL) {
+        useFile(d, p->args[0], false);
+      }
+      for (int k = 1; k < p->nargs; k++) {
+        if (p->args[k][0] != '-') {
+          useFile(d, p->args[k], writer);
+        }
+      }
+      if (p->rfin != NULL) {
+        useFile(d, p->rfin, false);
+      }
+      if (p->rfout != NULL) {
+        useFile(d, p->rfout, true);
+      }
     }
-    memset(dest, 0, strlen(dest));
-    token = strtok(NULL, delim);
   }
-  logPrint("Command not found on path: %s\n", tail);
-  printError();
-  return -1;
 }
 
-int redirectIO(Process *p) {
-  if (p->rfout != NULL) {
-    logPrint("Redirecting output to %s\n", p->rfout);
-    int fd = open(p->rfout, O_CREAT|O_WRONLY|O_TRUNC, S_IRWXU);
-    if (fd < 0){
-      logPrint("Failed to open file for output: %s\n", p->rfout);
-      printError();
-      return -1;
+bool dagLineDone(long seq) {
+  return seq < DAG.shown || DAG.window[seq % DAG.size].state == DAG_DONE;
+}
+
+bool dagLineReady(DagLine *d) {
+  for (int i = 0; i < d->ndeps; i++) {
+    if (!dagLineDone(d->deps[i])) {
+      return false;
     }
-    else {
-      dup2(fd, STDOUT_FILENO);
-    } 
   }
+  return true;
+}
 
-  if (p->rfin != NULL) {
-    logPrint("Redirecting input to %s\n", p->rfin);
-    int fd = open(p->rfin, O_RDONLY, S_IRWXU);
-    logPrint("Opened %s on fd %d\n", p->rfin, fd);
-    if (fd < 0){
-      logPrint("Failed to open file for input: %s\n", p->rfin);
-      printError();
-      return -1;
+bool dagLineFinished(DagLine *d) {
+  for (int i = 0; i < d->line.npgs; i++) {
+    if (d->line.pgs[i].running > 0) {
+      return false;
     }
-    else {
-      dup2(fd, STDIN_FILENO);
-    } 
   }
+  return true;
+}
 
-  return 0;
+// Read and parse the next line into the window. Returns false at the end.
+bool parseDagLine(Input *in, char **pending, size_t *pendingLen) {
+  char *text;
+  size_t len;
+  if (readLine(in, &text, &len) != 0) {
+    return false;
+  }
+  // A glob waits to be parsed until everything before it has run
+  if (hasGlobChars(text, len)) {
+    *pending = text;
+    *pendingLen = len;
+    return true;
+  }
+
+  DagLine *d = &DAG.window[DAG.parsed % DAG.size];
+  d->seq = DAG.parsed++;
+  d->state = DAG_WAITING;
+  d->out = memfd_create("wish-out", MFD_CLOEXEC);
+  d->err = memfd_create("wish-err", MFD_CLOEXEC);
+  if (d->out < 0 || d->err < 0) {
+    perror("memfd_create");
+    exit(1);
+  }
+  captureOutput(d);
+  parseInto(&d->line, text, len, false);
+  captureOutput(NULL);
+  addDagLine(d);
+  return true;
 }
 
-int executeChild(Process *p) {
-  char fullPath[MAX_PATH];
-  if (findOnPath(fullPath, p->args[0]) != 0){
-    _exit(1);
+void startDagLine(DagLine *d) {
+  logPrint("Starting line %ld with %d running\n", d->seq, DAG.running);
+  captureOutput(d);
+  DETACHED_LAUNCH = true;
+  launch(&d->line);
+  DETACHED_LAUNCH = false;
+  captureOutput(NULL);
+  d->state = DAG_RUNNING;
+  DAG.running++;
+  STATS.dagLines++;
+  if (DAG.running > STATS.dagPeak) {
+    STATS.dagPeak = DAG.running;
   }
-  // Possible error: not using full path for first arg?
-  logPrint("Exec'ing process: %s\n", fullPath);
-  execv(fullPath, p->args);
-  logPrint("execv failed\n");
-  perror("execv");
-  _exit(1);
 }
 
-int runSingleProcess(Process *p) {
-  // Save stdin and stdout
-  int savedIn = dup(STDIN_FILENO);
-  int savedOut = dup(STDOUT_FILENO);
-  logPrint("Saved io on %d and %d\n", savedIn, savedOut);
+void finishDagLine(DagLine *d) {
+  captureOutput(d);
+  finish(&d->line);
+  captureOutput(NULL);
+  d->state = DAG_DONE;
+  DAG.running--;
+}
 
-  if (redirectIO(p) != 0) {
-    logPrint("RedirectIO failed\n");
-    printError();
-    return -1;
+// Write out every finished line that has nothing unfinished before it
+void showDagLines() {
+  while (DAG.shown < DAG.parsed) {
+    DagLine *d = &DAG.window[DAG.shown % DAG.size];
+    if (d->state != DAG_DONE) {
+      return;
+    }
+    fflush(stdout);
+    lseek(d->out, 0, SEEK_SET);
+    lseek(d->err, 0, SEEK_SET);
+    copyFd(d->out, STDOUT_FILENO);
+    copyFd(d->err, STDERR_FILENO);
+    close(d->out);
+    close(d->err);
+    DAG.shown++;
   }
+}
 
-  int rc = tryBuiltIn(p);
-  if (rc == 1) {
-    logPrint("Could not find builtin, executing external command %s\n", p->args[0]);
-    rc = fork();
-    if (rc < 0) {
-      logPrint("Fork failed\n");
-      perror("fork");
-      exit(1);
-    }
-    else if (rc == 0) {
-      executeChild(p);
-    }
-    else {
-      p->pid = rc;
-      logPrint("Waiting for child\n");
-      wait(NULL);
-    }
+// Run a barrier once everything before it is done, as a plain run would
+void runDagBarrier(DagLine *d) {
+  STATS.dagBarriers++;
+  d->state = DAG_DONE;
+  DAG.shown++;
+  clearDagPaths();
+  fflush(stdout);
+  lseek(d->out, 0, SEEK_SET);
+  lseek(d->err, 0, SEEK_SET);
+  copyFd(d->out, STDOUT_FILENO);
+  copyFd(d->err, STDERR_FILENO);
+  close(d->out);
+  close(d->err);
+  launch(&d->line);
+  finish(&d->line);
+  if (getcwd(DAG.cwd, sizeof(DAG.cwd)) == NULL) {
+    DAG.cwd[0] = '\0';
   }
-  else if (rc < 0) {
-    dup2(savedIn, STDIN_FILENO);
-    dup2(savedOut, STDOUT_FILENO);
-    close(savedIn);
-    close(savedOut);
-    return -1;
+}
+
+void runDag(Input *in, int slots) {
+  DAG.slots = slots;
+  DAG.size = slots * 8 < 32 ? 32 : slots * 8 > 256 ? 256 : slots * 8;
+  DAG.window = calloc(DAG.size, sizeof(DagLine));
+  DAG.realOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+  DAG.realErr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+  if (getcwd(DAG.cwd, sizeof(DAG.cwd)) == NULL) {
+    DAG.cwd[0] = '\0';
+  }
+  if (EVENT_FD < 0) {
+    initEvents();
   }
+  LINE_INPUT = in;
 
-  // Restore stdin and stdout
-  logPrint("Restoring stdin/stdout using %d and %d\n", savedIn, savedOut);
-  dup2(savedIn, STDIN_FILENO);
-  dup2(savedOut, STDOUT_FILENO);
-  close(savedIn);
-  close(savedOut);
+  char *pending = NULL;
+  size_t pendingLen = 0;
+  bool more = true;
+  while (1) {
+    // Fill the window, stopping after a barrier
+    while (more && pending == NULL && DAG.parsed - DAG.shown < DAG.size &&
+        (DAG.parsed == DAG.shown || !DAG.window[(DAG.parsed - 1) % DAG.size].barrier)) {
+      more = parseDagLine(in, &pending, &pendingLen);
+    }
 
-  return 0;
-}
+    bool progress = false;
+    for (long seq = DAG.shown; seq < DAG.parsed; seq++) {
+      DagLine *d = &DAG.window[seq % DAG.size];
+      if (d->state == DAG_RUNNING && dagLineFinished(d)) {
+        finishDagLine(d);
+        progress = true;
+      }
+    }
+    showDagLines();
 
-void setupPipes(int fdin, int *fdpipe, bool shouldpipeout) {
-  logPrint("Duping pipe in\n");
-  dup2(fdin, STDIN_FILENO);
+    for (long seq = DAG.shown; seq < DAG.parsed && DAG.running < DAG.slots; seq++) {
+      DagLine *d = &DAG.window[seq % DAG.size];
+      if (d->state != DAG_WAITING) {
+        continue;
+      }
+      if (d->barrier) {
+        if (seq == DAG.shown && DAG.running == 0) {
+          runDagBarrier(d);
+          progress = true;
+        }
+        break;
+      }
+      if (dagLineReady(d)) {
+        startDagLine(d);
+        progress = true;
+      }
+    }
 
-  if (shouldpipeout) {
-    logPrint("Duping pipe out\n");
-    int rc = pipe(fdpipe);
-    if (rc < 0){
-      perror("pipe");
-      exit(1);
+    if (DAG.shown == DAG.parsed && pending != NULL) {
+      clearDagPaths();
+      eval(pending, pendingLen);
+      pending = NULL;
+      progress = true;
+      if (getcwd(DAG.cwd, sizeof(DAG.cwd)) == NULL) {
+        DAG.cwd[0] = '\0';
+      }
+    }
+    if (!more && pending == NULL && DAG.shown == DAG.parsed) {
+      break;
+    }
+    if (!progress && DAG.running > 0) {
+      waitForEvents();
     }
-    dup2(fdpipe[1], STDOUT_FILENO);
   }
+  printOverruns();
 }
 
-int runProcess(Process *p, int fdin, bool shouldpipeout) {
-  // Save stdin and stdout
-  int savedIn = dup(STDIN_FILENO);
-  int savedOut = dup(STDOUT_FILENO);
+/*
+  Server mode keeps one warm shell around: history, the search path and
+  the command hash are loaded once (plus whatever an optional init
+  script sets up) and every client gets a forked copy of that state to
+  run its script in. A couple of sessions are forked ahead of time and
+  wait in accept(), so a client never waits on a fork.
 
-  // Set up piping in and out
-  int fdpipe[2] = {-1, -1};
-  setupPipes(fdin, fdpipe, shouldpipeout);
+  A client sends a single message whose SCM_RIGHTS payload is its
+  script, stdin, stdout and stderr; the session reads and writes those
+  directly, so no output passes through the socket. When the session
+  exits, its exit status is sent back as an int.
+*/
+#define SESSION_FDS 4
+#define SESSION_MAGIC "wish"
+#define SPARE_SESSIONS 2
 
-  // Set up redirection (overrides piping if necessary)
-  if (redirectIO(p) != 0) {
-    logPrint("RedirectIO failed\n");
-    return -2;
+int SESSION_CONN = -1;
+pid_t SESSION_PID = 0;
+
+int receiveSessionFds(int conn, int *fds) {
+  char magic[sizeof(SESSION_MAGIC)];
+  char control[CMSG_SPACE(sizeof(int) * SESSION_FDS)];
+  struct iovec iov = {.iov_base = magic, .iov_len = sizeof(magic)};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+
+  if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != sizeof(magic)) {
+    return -1;
   }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int) * SESSION_FDS)) {
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * SESSION_FDS);
+  if (memcmp(magic, SESSION_MAGIC, sizeof(magic)) != 0) {
+    return -1;
+  }
+  return 0;
+}
 
-  // Fork and run
-  int rc = fork();
-  if (rc < 0) {
-    logPrint("Fork failed\n");
-    perror("fork");
-    exit(1);
+void reportSessionStatus(int status, void *arg) {
+  // Forked builtins that call exit() are not the session
+  if (getpid() != SESSION_PID) {
+    return;
   }
-  else if (rc == 0) {
-    // Close unecessary pipes
-    close(fdpipe[0]);
+  int32_t rc = status;
+  if (send(SESSION_CONN, &rc, sizeof(rc), MSG_NOSIGNAL) < 0) {
+    logPrint("Client went away\n");
+  }
+}
 
-    rc = tryBuiltIn(p);
-    if (rc == 1) {
-      executeChild(p);
-    }
-    
-    else if (rc == -1) {
-      logPrint("tryBuiltinFailed");
+/*
+  A pre-forked session: wait for one client, tell the server so it can
+  fork a replacement, then become a batch shell on the client's fds
+*/
+void runSession(int listener, int notify) {
+  close(EVENT_FD);
+  close(SIGNAL_FD);
+  close(THREAD_EVENT_FD);
+  close(TIMER_FD);
+  EVENT_FD = SIGNAL_FD = THREAD_EVENT_FD = TIMER_FD = -1;
+
+  // An idle spare goes when the server does; a busy one finishes its script
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  int conn;
+  while ((conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+    if (errno != EINTR && errno != ECONNABORTED) {
       _exit(1);
     }
+  }
+  prctl(PR_SET_PDEATHSIG, 0);
+  close(listener);
+  SESSION_PID = getpid();
+  if (write(notify, &SESSION_PID, sizeof(SESSION_PID)) < 0) {
+    _exit(1);
+  }
+  close(notify);
 
-    _exit(0);
+  int fds[SESSION_FDS];
+  if (receiveSessionFds(conn, fds) != 0) {
+    logPrint("Bad session request\n");
+    _exit(1);
   }
-  
-  // Save pid to wait on later
-  logPrint("Process %d was given pid %d\n", p->pid, rc);
-  p->pid = rc;
-  p->executed = true;
+  SESSION_CONN = conn;
+  on_exit(reportSessionStatus, NULL);
+  reloadPathDirs();
 
-  /*
-    The child now has its own copies of fdin and fdpipe.
-    Close the pipe in and pipe out values since we don't
-    need them anymore
-  */
-  close(fdin);
-  close(fdpipe[1]);
+  dup2(fds[1], STDIN_FILENO);
+  dup2(fds[2], STDOUT_FILENO);
+  dup2(fds[3], STDERR_FILENO);
+  for (int i = 1; i < SESSION_FDS; i++) {
+    if (fds[i] != fds[0] && fds[i] > STDERR_FILENO) {
+      close(fds[i]);
+    }
+  }
 
-  // Restore stdin and stdout
-  dup2(savedIn, STDIN_FILENO);
-  dup2(savedOut, STDOUT_FILENO);
-  close(savedIn);
-  close(savedOut);
+  Input in;
+  openInput(&in, fds[0]);
+  openPlan(PLAN.dir, &in);
+  runBatch(&in);
+  exit(0);
+}
 
-  p->executed = true;
-  return fdpipe[0];
+pid_t forkSession(int listener, int notify) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    runSession(listener, notify);
+  }
+  else if (pid < 0) {
+    perror("fork");
+  }
+  return pid;
 }
 
-void runAllGroups(int npgs, ProcessGroup *pgs) {
-  // Run all groups without waiting
-  logPrint("Running all groups\n");
-  for (int i = 0; i < npgs; i++) {
-    ProcessGroup *pg = &pgs[i];
-    pg->run = true;
-    logPrint("Running ProcessGroup %d\n", pg->pgid);
+int runServer(char *socketPath) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    printError();
+    return 1;
+  }
+  strcpy(addr.sun_path, socketPath);
 
-    int pipein = STDIN_FILENO;
-    for (int j = 0; j < pg->nprocesses; j++) {
-      Process *p = &(pg->processes[j]);
-      logPrint("\tRunning Processs %d\n", p->pid);
+  // Replace a socket left behind by an earlier server, but nothing else
+  struct stat st;
+  if (lstat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(socketPath);
+  }
 
-      bool shouldpipeout = j == pg->nprocesses-1 ? false : true;
-      pipein = runProcess(p, pipein, shouldpipeout);
-      if (pipein == -2) {
-        logPrint("runProcess failed on Process %d (%s)\n", p->pid, p->args[0]);
-        break;
-      }
-      else if (pipein == -1) {
-        logPrint("Last Process, pipein value is -1\n");
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 128) < 0) {
+    perror(socketPath);
+    return 1;
+  }
+
+  // Sessions write their pid here once they have a client
+  int notify[2];
+  if (pipe2(notify, O_CLOEXEC) < 0) {
+    perror("pipe");
+    return 1;
+  }
+
+  if (EVENT_FD < 0) {
+    initEvents();
+  }
+  struct epoll_event ev = {.events = EPOLLIN, .data.fd = notify[0]};
+  epoll_ctl(EVENT_FD, EPOLL_CTL_ADD, notify[0], &ev);
+
+  pid_t spares[SPARE_SESSIONS] = {0};
+  while (1) {
+    for (int i = 0; i < SPARE_SESSIONS; i++) {
+      if (spares[i] <= 0) {
+        spares[i] = forkSession(listener, notify[1]);
       }
     }
-  }
 
-  // Wait on all processes in all groups
-  logPrint("Waiting on all groups\n");
-  int status;
-  for (int i = 0; i < npgs; i++) {
-    ProcessGroup pg = pgs[i];
-    logPrint("Waiting on %d Processes in ProcessGroup %d\n", pg.nprocesses, pg.pgid);
-    // Don't wait if none of the processes were ever executed
-    if (pg.run) {
-      for (int j = 0; j < pg.nprocesses; j++) {
-        Process p = pg.processes[j];
-        printProcess(&p);
-        logPrint("\tWaiting on Process %d\n", p.pid);
-        // Don't wait if process was never executed
-        if (p.executed) {
-          waitpid(p.pid, &status, 0);
+    struct epoll_event events[8];
+    int n = epoll_wait(EVENT_FD, events, 8, -1);
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == SIGNAL_FD) {
+        struct signalfd_siginfo info;
+        while (read(SIGNAL_FD, &info, sizeof(info)) > 0) {
+          continue;
+        }
+      }
+      else if (events[i].data.fd == notify[0]) {
+        pid_t pid;
+        if (read(notify[0], &pid, sizeof(pid)) != sizeof(pid)) {
+          continue;
+        }
+        logPrint("Session %d has a client\n", pid);
+        for (int j = 0; j < SPARE_SESSIONS; j++) {
+          spares[j] = spares[j] == pid ? 0 : spares[j];
         }
       }
     }
-  } 
-}
 
-void run(int npgs, ProcessGroup *pgs){
-  // Save stdin and stdout
-  int savedIn = dup(STDIN_FILENO);
-  int savedOut = dup(STDOUT_FILENO);
-  logPrint("Saved io on %d and %d\n", savedIn, savedOut);
-
-  if (npgs == 1 && pgs[0].nprocesses == 1) {
-    logPrint("Running a single process\n");
-    runSingleProcess(&pgs[0].processes[0]);
-  }
-  else {
-    runAllGroups(npgs, pgs);
+    // A spare that died before getting a client also needs replacing
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      for (int j = 0; j < SPARE_SESSIONS; j++) {
+        spares[j] = spares[j] == pid ? 0 : spares[j];
+      }
+    }
   }
-
-  // Restore stdin and stdout
-  dup2(savedIn, STDIN_FILENO);
-  dup2(savedOut, STDOUT_FILENO);
-  close(savedIn);
-  close(savedOut);
 }
 
-void eval(char *line){
-  // Parse line into ProcessGroups and Processes
-  // Each ProcessGroup is run in the background together (or not)
-  ProcessGroup *pgs; // an array of ProcessGroup structs
-  int npgs = parseLine(&pgs, line);
+// Hand our script and stdio to a server and wait for the session's status
+int runClient(char *socketPath, char *script) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    printError();
+    return 1;
+  }
+  strcpy(addr.sun_path, socketPath);
 
-  if (npgs < 0) {
-    logPrint("parseLine failed\n");
-    return;
+  int fds[SESSION_FDS] = {STDIN_FILENO, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  if (script != NULL && (fds[0] = open(script, O_RDONLY | O_CLOEXEC)) < 0) {
+    printError();
+    return 1;
   }
-  else if (npgs == 0) {
-    // If there are no processes, don't run anything
-    logPrint("No processes to execute\n");
-    return;
+
+  int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn < 0 || connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror(socketPath);
+    return 1;
   }
 
-  run(npgs, pgs);
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {.iov_base = SESSION_MAGIC, .iov_len = sizeof(SESSION_MAGIC)};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(conn, &msg, 0) < 0) {
+    perror(socketPath);
+    return 1;
+  }
 
-  cleanup(pgs, npgs);
-  free(pgs);
+  int32_t rc;
+  if (recv(conn, &rc, sizeof(rc), MSG_WAITALL) != sizeof(rc)) {
+    printError();
+    return 1;
+  }
+  return rc;
 }
 
 int main(int argc, char** argv){
-  char* line;
-  size_t size = 0;
-  FILE* filein = stdin;
+  int fd = STDIN_FILENO;
   bool interactive = true;
+  initTracing();
+  pickTextRoutines();
+
+  // Options come before everything else
+  PLAN.dir = getenv("WISH_PLAN_CACHE");
+  while (argc >= 2 && (strcmp(argv[1], "--plan-cache") == 0 ||
+      strcmp(argv[1], "--line-deadline") == 0)) {
+    if (argc < 3) {
+      printError();
+      exit(1);
+    }
+    if (strcmp(argv[1], "--plan-cache") == 0) {
+      PLAN.dir = argv[2];
+    }
+    else if (parseDuration(argv[2], &LINE_DEADLINE) != 0) {
+      printError();
+      exit(1);
+    }
+    argc -= 2;
+    argv += 2;
+  }
+
+  // wish -j N script
+  int dagSlots = 0;
+  if (argc >= 2 && strcmp(argv[1], "-j") == 0) {
+    if (argc != 4 || atoi(argv[2]) < 1) {
+      printError();
+      exit(1);
+    }
+    dagSlots = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+
+  // wish --client SOCKET [script]
+  if (argc >= 2 && strcmp(argv[1], "--client") == 0) {
+    if (argc < 3 || argc > 4) {
+      printError();
+      exit(1);
+    }
+    return runClient(argv[2], argc == 4 ? argv[3] : NULL);
+  }
+
+  // wish --server SOCKET [init-script]
+  if (argc >= 2 && strcmp(argv[1], "--server") == 0) {
+    if (argc < 3 || argc > 4) {
+      printError();
+      exit(1);
+    }
+    initHistory(false);
+    initJobSlots();
+    if (argc == 4) {
+      Input init;
+      int initFd = open(argv[3], O_RDONLY | O_CLOEXEC);
+      if (initFd < 0) {
+        printError();
+        exit(1);
+      }
+      openInput(&init, initFd);
+      runBatch(&init);
+    }
+    return runServer(argv[2]);
+  }
 
   if (argc > 2) {
     printError();
     exit(1);
   }
   else if (argc == 2) {
-    filein = fopen(argv[1], "r");
-    if (filein == NULL) {
+    fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
       printError();
       exit(1);
     }
     interactive = false;
   }
 
-  while(1){
-    if (interactive) {
-      printf("wish> ");
+  initHistory(interactive);
+  INTERACTIVE = interactive;
+  initJobSlots();
+  if (interactive) {
+    initJobControl();
+  }
+
+  Input in;
+  openInput(&in, fd);
+
+  if (!interactive) {
+    openPlan(PLAN.dir, &in);
+    if (dagSlots > 0) {
+      runDag(&in, dagSlots);
+    }
+    else {
+      runBatch(&in);
     }
+    return 0;
+  }
 
-    int nchar = getline(&line, &size, filein); 
-    if (nchar < 0){
-      break;
+  LINE_INPUT = &in;
+  while(1){
+    notifyJobs();
+    char *line;
+    size_t len;
+    if (JOB_CONTROL) {
+      if (editLine("wish> ", &line, &len) != 0) {
+        break;
+      }
+    }
+    else {
+      printf("wish> ");
+      fflush(stdout);
+      if (readLine(&in, &line, &len) != 0){
+        break;
+      }
     }
 
-    eval(line);
+    eval(line, len);
   }
 
   return 0;